@@ -7,18 +7,19 @@
 #define NUMBER_OF_SAMPLES   15
 #define MAX_TREE_DEPTH      3
 typedef int8_t Treetype;
+typedef uint8_t Labeltype;
 Treetype X_const[NUMBER_OF_SAMPLES][NUMBER_OF_FEATURES];
-Treetype Y_const[NUMBER_OF_SAMPLES][1];
+Labeltype Y_const[NUMBER_OF_SAMPLES][1];
 
 Treetype **X;
-Treetype **Y;
+Labeltype **Y;
 
 void fillBuffersWithRandom(void){
   for(uint32_t i=0;i<NUMBER_OF_SAMPLES;i++){
     for(uint32_t j=0;j<NUMBER_OF_FEATURES;j++){
         X_const[i][j]=(Treetype)random(-128,127);
       }
-      Y_const[i][0] = (Treetype)random(-128,127);
+      Y_const[i][0] = (Labeltype)random(-128,127);
   }
 }
 
@@ -26,7 +27,7 @@ void setup() {
   Serial.begin(115200);
   Serial.println();
   X = new Treetype *[NUMBER_OF_SAMPLES];
-  Y = new Treetype *[NUMBER_OF_SAMPLES];
+  Y = new Labeltype *[NUMBER_OF_SAMPLES];
   for(uint32_t i=0;i<NUMBER_OF_SAMPLES;i++){
       X[i] = X_const[i];
       Y[i] = Y_const[i];
@@ -38,7 +39,7 @@ void setup() {
   uint32_t after;
 
   MEMORY_PRINT_FREERAM
-  TinyDecisionTreeClassifier<Treetype> clf(MAX_TREE_DEPTH,2);
+  TinyDecisionTreeClassifier<Treetype,Labeltype> clf(MAX_TREE_DEPTH,2);
 
   before = micros();
   clf.fit(X,Y,NUMBER_OF_SAMPLES,NUMBER_OF_FEATURES);
@@ -50,7 +51,7 @@ void setup() {
   Serial.print("Accuracy:");
   Serial.println(clf.score(X,Y,NUMBER_OF_SAMPLES));
   clf.plot();
-  Treetype rslt;
+  Labeltype rslt;
   for(uint32_t i=0;i<NUMBER_OF_SAMPLES;i++){
       before = micros();
       rslt = clf.predict(X[i]);
@@ -6,17 +6,18 @@
 #define NUMBER_OF_SAMPLES   10
 #define MAX_TREE_DEPTH      3
 typedef float Treetype;
+typedef uint8_t Labeltype;
 Treetype X_const[NUMBER_OF_SAMPLES][NUMBER_OF_FEATURES];
-Treetype Y_const[NUMBER_OF_SAMPLES][1];
+Labeltype Y_const[NUMBER_OF_SAMPLES][1];
 Treetype **X;
-Treetype **Y;
+Labeltype **Y;
 
 void fillBuffersWithRandom(void){
   for(uint32_t i=0;i<NUMBER_OF_SAMPLES;i++){
     for(uint32_t j=0;j<NUMBER_OF_FEATURES;j++){
         X_const[i][j]=(Treetype)random(-128,127);
       }
-      Y_const[i][0] = (Treetype)random(-128,127);
+      Y_const[i][0] = (Labeltype)random(-128,127);
   }
 }
 
@@ -24,22 +25,22 @@ void fillBuffersWithRandom(void){
 void benchmark(void){
   uint32_t timeBefore;
   uint32_t timeAfter;
-  uint32_t heapBefore;
-  uint32_t heapAfter;
+  uint32_t treeBytes;
+  uint32_t peakBytes;
   uint64_t benchmarkingTrainingTime = 0;
   uint64_t benchmarkingPredictionTime = 0;
   Serial.println("Bechmarking start");
 
   for(uint32_t i=0;i<BENCHMARK_AVERAGING;i++){
-    heapBefore = ESP.getFreeHeap();
-    TinyDecisionTreeClassifier<Treetype> clf(MAX_TREE_DEPTH,2);
+    TinyDecisionTreeClassifier<Treetype,Labeltype,TinyCountingAllocator<> > clf(MAX_TREE_DEPTH,2);
     fillBuffersWithRandom();
     timeBefore = micros();
     clf.fit(X,Y,NUMBER_OF_SAMPLES,NUMBER_OF_FEATURES);
     timeAfter = micros();
-    heapAfter = ESP.getFreeHeap();
+    treeBytes = clf.allocator.currentBytes;
+    peakBytes = clf.allocator.peakBytes;
     benchmarkingTrainingTime+=(timeAfter-timeBefore);
-    Treetype rslt;
+    Labeltype rslt;
     for(uint32_t j=0;j<NUMBER_OF_SAMPLES;j++){
         timeBefore = micros();
         rslt = clf.predict(X[j]);
@@ -48,7 +49,10 @@ void benchmark(void){
     }
   }
   Serial.print("Size in bytes: ");
-  Serial.print(heapBefore - heapAfter);
+  Serial.print(treeBytes);
+  Serial.println(" bytes");
+  Serial.print("Peak memory during training: ");
+  Serial.print(peakBytes);
   Serial.println(" bytes");
   Serial.print("Training time: ");
   Serial.print(benchmarkingTrainingTime/BENCHMARK_AVERAGING);
@@ -65,7 +69,7 @@ void setup() {
   Serial.begin(115200);
   Serial.println("DTR start");
   X = new Treetype *[NUMBER_OF_SAMPLES];
-  Y = new Treetype *[NUMBER_OF_SAMPLES];
+  Y = new Labeltype *[NUMBER_OF_SAMPLES];
   for(uint32_t i=0;i<NUMBER_OF_SAMPLES;i++){
       X[i] = X_const[i];
       Y[i] = Y_const[i];
@@ -6,17 +6,18 @@
 #define NUMBER_OF_SAMPLES   30
 #define MAX_TREE_DEPTH      3
 typedef float Treetype;
+typedef int8_t Labeltype;
 Treetype X_const[NUMBER_OF_SAMPLES][NUMBER_OF_FEATURES];
-Treetype Y_const[NUMBER_OF_SAMPLES][1];
+Labeltype Y_const[NUMBER_OF_SAMPLES][1];
 Treetype **X;
-Treetype **Y;
+Labeltype **Y;
 
 void fillBuffersWithRandom(void){
   for(uint32_t i=0;i<NUMBER_OF_SAMPLES;i++){
     for(uint32_t j=0;j<NUMBER_OF_FEATURES;j++){
         X_const[i][j]=(Treetype)random(-128,127);
       }
-      Y_const[i][0] = (Treetype)random(-128,127);
+      Y_const[i][0] = (Labeltype)random(-128,127);
   }
 }
 
@@ -28,13 +29,13 @@ void benchmark(void){
   uint64_t benchmarkingPredictionTime = 0;
   Serial.println("Bechmarking start");
   for(uint32_t i=0;i<BENCHMARK_AVERAGING;i++){
-    TinyDecisionTreeClassifier<Treetype> clf(MAX_TREE_DEPTH,2);
+    TinyDecisionTreeClassifier<Treetype,Labeltype> clf(MAX_TREE_DEPTH,2);
     fillBuffersWithRandom();
     timeBefore = micros();
     clf.fit(X,Y,NUMBER_OF_SAMPLES,NUMBER_OF_FEATURES);
     timeAfter = micros();
     benchmarkingTrainingTime+=(timeAfter-timeBefore);
-    Treetype rslt;
+    Labeltype rslt;
     for(uint32_t j=0;j<NUMBER_OF_SAMPLES;j++){
         timeBefore = micros();
         rslt = clf.predict(X[j]);
@@ -56,7 +57,7 @@ void benchmark(void){
 void setup() {
   Serial.begin(115200); 
   X = new Treetype *[NUMBER_OF_SAMPLES];
-  Y = new Treetype *[NUMBER_OF_SAMPLES];
+  Y = new Labeltype *[NUMBER_OF_SAMPLES];
   for(uint32_t i=0;i<NUMBER_OF_SAMPLES;i++){
       X[i] = X_const[i];
       Y[i] = Y_const[i];
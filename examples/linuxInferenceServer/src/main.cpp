@@ -0,0 +1,321 @@
+// Local inference daemon: maps a model store (see linuxTrainer and TinyModelStore) once and serves predictions
+// to other processes over a Unix domain socket. Concurrent requests are queued and a small pool of workers takes them
+// in micro-batches, a batch is closed when it is full or its oldest request has waited the latency cap.
+// The requests of one model in a batch go down the tree together (TinyModelStore batched predict).
+//
+// Protocol, native byte order, any number of requests per connection and they can be pipelined:
+//   request:  uint32 tag, uint32 features, uint64 model id, features float32 values
+//   response: uint32 tag, int16 status (0, MODEL_NOT_FOUND or TOO_FEW_FEATURES), uint16 outputs, outputs uint8 classes
+//
+// Usage: linuxInferenceServer [options] store
+//   -s, --socket PATH        socket path (default /tmp/tinytree.sock)
+//   -w, --workers N          worker threads (default 2)
+//   -b, --batch N            maximum batch size (default 64)
+//   -l, --latency US         maximum time a request waits for its batch in microseconds (default 200)
+//   -B, --bench N            client mode: sends N requests with random features for every model id given after the store
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include "TinyDecisionTreeModelStore.h"
+
+typedef float Treetype;
+typedef uint8_t Labeltype;
+
+#define MODEL_NOT_FOUND -1
+#define TOO_FEW_FEATURES -2
+//Larger requests are rejected, the connection is closed
+#define MAX_FEATURES 4096
+
+struct RequestHeader{
+  uint32_t tag;
+  uint32_t features;
+  uint64_t model;
+};
+
+struct ResponseHeader{
+  uint32_t tag;
+  int16_t status;
+  uint16_t outputs;
+};
+
+//One client connection, the readers and the workers share it until both are done
+struct Connection{
+  int fd;
+  std::mutex writeLock;
+  Connection(int fd) : fd(fd){}
+  ~Connection(){
+    close(fd);
+  }
+};
+
+struct Request{
+  std::shared_ptr<Connection> connection;
+  RequestHeader header;
+  std::vector<Treetype> X;
+  std::chrono::steady_clock::time_point arrived;
+};
+
+static TinyModelStore<Treetype,Labeltype> store;
+static std::mutex queueLock;
+static std::condition_variable queueReady;
+static std::deque<Request*> queue;
+static uint32_t maxBatch = 64;
+static std::chrono::microseconds latency(200);
+//Features every model reads, found once per model and kept
+static std::mutex featuresLock;
+static std::unordered_map<uint64_t,uint32_t> modelFeatures;
+
+static uint32_t featuresOf(uint64_t model){
+  std::lock_guard<std::mutex> lock(featuresLock);
+  std::unordered_map<uint64_t,uint32_t>::iterator found = modelFeatures.find(model);
+  if(found!=modelFeatures.end())return found->second;
+  uint32_t features = store.features(model);
+  modelFeatures[model] = features;
+  return features;
+}
+
+static bool readAll(int fd, void* buffer, size_t size){
+  uint8_t* p = (uint8_t*)buffer;
+  while(size>0){
+    ssize_t n = read(fd,p,size);
+    if(n<0 && errno==EINTR)continue;
+    if(n<=0)return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool writeAll(int fd, const void* buffer, size_t size){
+  const uint8_t* p = (const uint8_t*)buffer;
+  while(size>0){
+    ssize_t n = write(fd,p,size);
+    if(n<0 && errno==EINTR)continue;
+    if(n<=0)return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+//Reads the requests of a connection and queues them, the responses are written by the workers
+static void reader(std::shared_ptr<Connection> connection){
+  for(;;){
+    Request* request = new Request();
+    if(!readAll(connection->fd,&request->header,sizeof(RequestHeader)) || request->header.features>MAX_FEATURES){
+      delete request;
+      return;
+    }
+    request->X.resize(request->header.features);
+    if(!readAll(connection->fd,request->X.data(),request->header.features*sizeof(Treetype))){
+      delete request;
+      return;
+    }
+    request->connection = connection;
+    request->arrived = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(queueLock);
+    queue.push_back(request);
+    if(queue.size()==1 || queue.size()>=maxBatch)queueReady.notify_one();
+  }
+}
+
+static void respond(Request* request, int16_t status, uint16_t outputs, const Labeltype* Y){
+  uint8_t buffer[sizeof(ResponseHeader)+65536*sizeof(Labeltype)];
+  ResponseHeader header = {request->header.tag,status,outputs};
+  memcpy(buffer,&header,sizeof(header));
+  if(outputs)memcpy(buffer+sizeof(header),Y,outputs*sizeof(Labeltype));
+  std::lock_guard<std::mutex> lock(request->connection->writeLock);
+  writeAll(request->connection->fd,buffer,sizeof(header)+outputs*sizeof(Labeltype));
+}
+
+//Takes a batch when it is full or the oldest request has waited long enough, then scores it grouped by model
+static void worker(void){
+  std::vector<Request*> batch;
+  std::vector<const Treetype*> X;
+  std::vector<Labeltype> Y;
+  for(;;){
+    batch.clear();
+    {
+      std::unique_lock<std::mutex> lock(queueLock);
+      queueReady.wait(lock,[]{return !queue.empty();});
+      std::chrono::steady_clock::time_point deadline = queue.front()->arrived+latency;
+      queueReady.wait_until(lock,deadline,[]{return queue.size()>=maxBatch;});
+      while(!queue.empty() && batch.size()<maxBatch){
+        batch.push_back(queue.front());
+        queue.pop_front();
+      }
+      //The rest belongs to the next batch, another worker can start on it
+      if(!queue.empty())queueReady.notify_one();
+    }
+    std::stable_sort(batch.begin(),batch.end(),[](const Request* a, const Request* b){return a->header.model<b->header.model;});
+    for(size_t first=0;first<batch.size();){
+      uint64_t model = batch[first]->header.model;
+      size_t end = first;
+      while(end<batch.size() && batch[end]->header.model==model)end++;
+      uint16_t outputs = store.outputs(model);
+      if(outputs==0){
+        for(size_t i=first;i<end;i++)respond(batch[i],MODEL_NOT_FOUND,0,NULL);
+      }else{
+        uint32_t features = featuresOf(model);
+        X.clear();
+        for(size_t i=first;i<end;i++){
+          if(batch[i]->header.features<features)respond(batch[i],TOO_FEW_FEATURES,0,NULL);
+          else X.push_back(batch[i]->X.data());
+        }
+        Y.resize(X.size()*outputs);
+        store.predict(model,X.data(),X.size(),Y.data());
+        size_t k = 0;
+        for(size_t i=first;i<end;i++){
+          if(batch[i]->header.features>=features)respond(batch[i],0,outputs,Y.data()+(k++)*outputs);
+        }
+      }
+      first = end;
+    }
+    for(Request* request : batch)delete request;
+  }
+}
+
+static int connectTo(const char* path){
+  int fd = socket(AF_UNIX,SOCK_STREAM,0);
+  struct sockaddr_un address;
+  memset(&address,0,sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path,path,sizeof(address.sun_path)-1);
+  if(fd<0 || connect(fd,(struct sockaddr*)&address,sizeof(address))!=0){
+    if(fd>=0)close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+//Client mode: one thread per model id, each pipelines its requests and checks the answers against the store
+static int bench(const char* path, uint32_t requests, char** ids, int count){
+  std::vector<std::thread> clients;
+  std::vector<uint32_t> errors(count,0);
+  double t0 = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  for(int c=0;c<count;c++){
+    clients.push_back(std::thread([=,&errors]{
+      uint64_t model = strtoull(ids[c],NULL,10);
+      int fd = connectTo(path);
+      if(fd<0){
+        errors[c] = requests;
+        return;
+      }
+      const uint32_t features = 16;
+      std::vector<Treetype> sent((size_t)requests*features);
+      uint32_t state = c+1;
+      for(size_t i=0;i<sent.size();i++){
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        sent[i] = (Treetype)(state%1000)/10;
+      }
+      std::thread writer([&]{
+        for(uint32_t i=0;i<requests;i++){
+          RequestHeader header = {i,features,model};
+          writeAll(fd,&header,sizeof(header));
+          writeAll(fd,sent.data()+(size_t)i*features,features*sizeof(Treetype));
+        }
+      });
+      Labeltype Y[65536];
+      Labeltype expected[65536];
+      for(uint32_t i=0;i<requests;i++){
+        ResponseHeader header;
+        if(!readAll(fd,&header,sizeof(header)) || !readAll(fd,Y,header.outputs*sizeof(Labeltype))){
+          errors[c] += requests-i;
+          break;
+        }
+        if(header.status!=0 || header.tag>=requests || !store.predict(model,sent.data()+(size_t)header.tag*features,expected)
+          || memcmp(Y,expected,header.outputs*sizeof(Labeltype))!=0)errors[c]++;
+      }
+      writer.join();
+      close(fd);
+    }));
+  }
+  uint32_t failed = 0;
+  for(int c=0;c<count;c++){
+    clients[c].join();
+    failed += errors[c];
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count()-t0;
+  printf("%u requests, %u wrong or failed, %.0f predictions/s\n",requests*count,failed,requests*count/(seconds>0 ? seconds : 1e-9));
+  return failed ? 1 : 0;
+}
+
+static void usage(void){
+  fprintf(stderr,"Usage: linuxInferenceServer [-s socket] [-w workers] [-b batch] [-l latencyUs] [-B requests] store [model ids for -B]\n");
+}
+
+int main(int argc, char** argv){
+  static const struct option options[] = {
+    {"socket",required_argument,NULL,'s'},
+    {"workers",required_argument,NULL,'w'},
+    {"batch",required_argument,NULL,'b'},
+    {"latency",required_argument,NULL,'l'},
+    {"bench",required_argument,NULL,'B'},
+    {NULL,0,NULL,0}
+  };
+  const char* path = "/tmp/tinytree.sock";
+  uint32_t workers = 2;
+  uint32_t benchRequests = 0;
+  int c;
+  while((c = getopt_long(argc,argv,"s:w:b:l:B:",options,NULL))!=-1){
+    switch(c){
+      case 's': path = optarg; break;
+      case 'w': workers = atoi(optarg); break;
+      case 'b': maxBatch = atoi(optarg); break;
+      case 'l': latency = std::chrono::microseconds(atoi(optarg)); break;
+      case 'B': benchRequests = atoi(optarg); break;
+      default: usage(); return 1;
+    }
+  }
+  if(optind>=argc || workers==0 || maxBatch==0 || (benchRequests==0 && optind!=argc-1)){
+    usage();
+    return 1;
+  }
+  if(store.open(argv[optind],false)!=0){
+    fprintf(stderr,"Can't open the store %s\n",argv[optind]);
+    return 1;
+  }
+  if(benchRequests)return bench(path,benchRequests,argv+optind+1,argc-optind-1);
+
+  signal(SIGPIPE,SIG_IGN);
+  int listener = socket(AF_UNIX,SOCK_STREAM,0);
+  struct sockaddr_un address;
+  memset(&address,0,sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path,path,sizeof(address.sun_path)-1);
+  unlink(path);
+  if(listener<0 || bind(listener,(struct sockaddr*)&address,sizeof(address))!=0 || listen(listener,64)!=0){
+    fprintf(stderr,"Can't listen on %s\n",path);
+    return 1;
+  }
+  printf("Serving %lu models on %s, %u workers, batches of %u, %ld us latency cap\n",(unsigned long)store.size(),path,workers,maxBatch,(long)latency.count());
+  fflush(stdout);
+  for(uint32_t i=0;i<workers;i++)std::thread(worker).detach();
+  for(;;){
+    int fd = accept(listener,NULL,NULL);
+    if(fd<0){
+      if(errno==EINTR)continue;
+      return 1;
+    }
+    std::thread(reader,std::make_shared<Connection>(fd)).detach();
+  }
+}
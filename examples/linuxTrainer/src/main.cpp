@@ -0,0 +1,563 @@
+// Host side trainer: memory-maps a CSV or raw binary dataset, fits the tree and writes the model
+// as a C header (source) or in the exportModel format (binary) together with timing and accuracy stats.
+//
+// CSV:    one sample per line, the features followed by the labels, separated by ',', ';', tabs or spaces.
+// Binary: rows of float32 values in the native byte order, the features followed by the labels.
+//
+// Usage: linuxTrainer [options] dataset
+//   -c, --features N         number of features (required for binary, CSV takes all but the labels)
+//   -y, --outputs N          number of label columns (default 1)
+//   -f, --format csv|bin     dataset format (default by the extension, .bin is binary)
+//   -H, --header             skip the first CSV line
+//   -d, --depth N            maxDepth (default 8)
+//   -s, --min-split N        minSamplesSplit (default 2)
+//   -m, --max-features N     maxFeatures, a number, sqrt or log2
+//   -r, --random N           extremely randomized splits with N thresholds per feature
+//   -S, --subsample N        subsampleThreshold, nodes above it search on subsampleSize=N/4 rows
+//   -t, --test FRACTION      fraction of the rows held out for the test accuracy (default 0.2)
+//   -k, --costs LIST         comma separated cost of every feature, reported as the expected cost per prediction
+//   -l, --cost-penalty L     splits maximize the information gain minus L times the feature cost
+//   -p, --prune ALPHA        cost-complexity pruning
+//   -C, --compact            merge identical subtrees
+//   -P, --profile            lay the nodes out hot path first, profiled on the training rows; the source model tests the hot branch first
+//   -o, --output FILE        model file
+//   -F, --model source|bin   model format (default by the extension, .bin is binary)
+//   -D, --delta BASE         also write FILE.delta, the binary model as a TinyModelDelta against the binary model BASE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "TinyDecisionTreeClassifier.h"
+#include "TinyDecisionTreeDelta.h"
+
+typedef float Treetype;
+typedef uint8_t Labeltype;
+typedef TinyDecisionTreeClassifier<Treetype,Labeltype,TinyCountingAllocator<> > Classifier;
+
+struct Dataset{
+  uint32_t rows;
+  uint32_t features;
+  uint16_t outputs;
+  Treetype* values;       //Parsed CSV values, NULL if X points into the mapped file
+  Treetype** X;
+  Labeltype* labels;
+  Labeltype** Y;
+};
+
+static double now(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+static bool endsWith(const char* s, const char* suffix){
+  size_t n = strlen(s);
+  size_t m = strlen(suffix);
+  return n>=m && strcmp(s+n-m,suffix)==0;
+}
+
+static inline bool isSeparator(char c){
+  return c==',' || c==';' || c=='\t' || c==' ';
+}
+
+//Parses a number in place, no copies and no locale, returns the position after it
+static const char* parseNumber(const char* p, const char* end, double* value){
+  static const double powers[] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+  bool negative = false;
+  if(p<end && (*p=='-' || *p=='+')){
+    negative = (*p=='-');
+    p++;
+  }
+  uint64_t mantissa = 0;
+  int32_t exponent = 0;
+  uint32_t digits = 0;
+  while(p<end && *p>='0' && *p<='9'){
+    if(digits<19){
+      mantissa = mantissa*10+(*p-'0');
+      digits++;
+    }else{
+      exponent++;
+    }
+    p++;
+  }
+  if(p<end && *p=='.'){
+    p++;
+    while(p<end && *p>='0' && *p<='9'){
+      if(digits<19){
+        mantissa = mantissa*10+(*p-'0');
+        digits++;
+        exponent--;
+      }
+      p++;
+    }
+  }
+  if(p<end && (*p=='e' || *p=='E')){
+    p++;
+    bool negativeExponent = false;
+    if(p<end && (*p=='-' || *p=='+')){
+      negativeExponent = (*p=='-');
+      p++;
+    }
+    int32_t e = 0;
+    while(p<end && *p>='0' && *p<='9'){
+      if(e<10000)e = e*10+(*p-'0');
+      p++;
+    }
+    exponent += negativeExponent ? -e : e;
+  }
+  double v = (double)mantissa;
+  while(exponent>22){
+    v *= 1e22;
+    exponent -= 22;
+  }
+  while(exponent<-22){
+    v /= 1e22;
+    exponent += 22;
+  }
+  v = exponent<0 ? v/powers[-exponent] : v*powers[exponent];
+  *value = negative ? -v : v;
+  return p;
+}
+
+static bool setLabel(Dataset* d, uint32_t row, uint16_t o, double v){
+  if(v<0 || v>255 || v!=(double)(Labeltype)v){
+    fprintf(stderr,"Row %u: label %g is not an integer in 0..255\n",row,v);
+    return false;
+  }
+  d->labels[(size_t)row*d->outputs+o] = (Labeltype)v;
+  return true;
+}
+
+static bool allocateRows(Dataset* d){
+  d->X = (Treetype**)malloc((size_t)d->rows*sizeof(Treetype*));
+  d->Y = (Labeltype**)malloc((size_t)d->rows*sizeof(Labeltype*));
+  d->labels = (Labeltype*)malloc((size_t)d->rows*d->outputs*sizeof(Labeltype));
+  if(d->X==NULL || d->Y==NULL || d->labels==NULL)return false;
+  for(uint32_t i=0;i<d->rows;i++){
+    d->Y[i] = d->labels+(size_t)i*d->outputs;
+  }
+  return true;
+}
+
+static bool loadCsv(const char* data, size_t size, bool header, uint32_t features, Dataset* d){
+  const char* p = data;
+  const char* end = data+size;
+  if(header){
+    const char* nl = (const char*)memchr(p,'\n',end-p);
+    p = nl ? nl+1 : end;
+  }
+  //The first line gives the number of columns, then all the lines are counted with memchr
+  const char* firstEnd = (const char*)memchr(p,'\n',end-p);
+  if(firstEnd==NULL)firstEnd = end;
+  uint32_t columns = 0;
+  for(const char* q=p;q<firstEnd;){
+    while(q<firstEnd && isSeparator(*q))q++;
+    if(q>=firstEnd || *q=='\r')break;
+    columns++;
+    while(q<firstEnd && !isSeparator(*q) && *q!='\r')q++;
+  }
+  if(columns<=d->outputs){
+    fprintf(stderr,"The first line has %u columns, at least %u are needed\n",columns,d->outputs+1);
+    return false;
+  }
+  d->features = features ? features : columns-d->outputs;
+  if(d->features+d->outputs!=columns){
+    fprintf(stderr,"The first line has %u columns, %u features and %u outputs were requested\n",columns,d->features,d->outputs);
+    return false;
+  }
+  uint32_t rows = 0;
+  for(const char* q=p;q<end;){
+    const char* nl = (const char*)memchr(q,'\n',end-q);
+    const char* lineEnd = nl ? nl : end;
+    if(lineEnd>q && !(lineEnd-q==1 && *q=='\r'))rows++;
+    q = lineEnd+1;
+  }
+  d->rows = rows;
+  d->values = (Treetype*)malloc((size_t)rows*d->features*sizeof(Treetype));
+  if(d->values==NULL || !allocateRows(d)){
+    fprintf(stderr,"Not enough memory for %u rows\n",rows);
+    return false;
+  }
+
+  uint32_t row = 0;
+  while(p<end && row<rows){
+    const char* nl = (const char*)memchr(p,'\n',end-p);
+    const char* lineEnd = nl ? nl : end;
+    if(lineEnd-p==0 || (lineEnd-p==1 && *p=='\r')){
+      p = lineEnd+1;
+      continue;
+    }
+    Treetype* x = d->values+(size_t)row*d->features;
+    d->X[row] = x;
+    uint32_t column = 0;
+    while(p<lineEnd){
+      while(p<lineEnd && isSeparator(*p))p++;
+      if(p>=lineEnd || *p=='\r')break;
+      double v;
+      const char* next = parseNumber(p,lineEnd,&v);
+      if(next==p || column>=columns){
+        fprintf(stderr,"Line %u: can't parse column %u\n",row+1+(header?1:0),column+1);
+        return false;
+      }
+      if(column<d->features)x[column] = (Treetype)v;
+      else if(!setLabel(d,row,column-d->features,v))return false;
+      column++;
+      p = next;
+    }
+    if(column!=columns){
+      fprintf(stderr,"Line %u has %u columns instead of %u\n",row+1+(header?1:0),column,columns);
+      return false;
+    }
+    row++;
+    p = lineEnd+1;
+  }
+  return true;
+}
+
+static bool loadBinary(const char* data, size_t size, uint32_t features, Dataset* d){
+  if(features==0){
+    fprintf(stderr,"Binary datasets need the number of features (-c)\n");
+    return false;
+  }
+  size_t stride = (size_t)(features+d->outputs)*sizeof(float);
+  if(size%stride!=0){
+    fprintf(stderr,"The file size is not a multiple of %zu bytes per row\n",stride);
+    return false;
+  }
+  d->features = features;
+  d->rows = size/stride;
+  if(!allocateRows(d)){
+    fprintf(stderr,"Not enough memory for %u rows\n",d->rows);
+    return false;
+  }
+  //The features are used right from the mapped pages, only the labels are converted
+  for(uint32_t i=0;i<d->rows;i++){
+    const float* row = (const float*)(data+i*stride);
+    d->X[i] = (Treetype*)row;
+    for(uint16_t o=0;o<d->outputs;o++){
+      if(!setLabel(d,i,o,row[features+o]))return false;
+    }
+  }
+  return true;
+}
+
+//relayout() stores the hot child right after its parent, hotFirst writes that branch as the if
+static void writeSourceNode(FILE* f, Classifier::Node* node, uint32_t depth, uint16_t outputs, bool hotFirst){
+  for(uint32_t i=0;i<depth;i++)fputs("    ",f);
+  if(node->children[0]==NULL){
+    for(uint16_t o=0;o<outputs;o++){
+      fprintf(f,"Y[%u]=%u;",o,(unsigned)(node->decisions ? node->decisions[o] : node->decision));
+    }
+    fputs("\n",f);
+    return;
+  }
+  uint8_t first = hotFirst && node->children[1]==node+1 ? 1 : 0;
+  fprintf(f,first ? "if(!(X[%u]<=%.9ef)){\n" : "if(X[%u]<=%.9ef){\n",node->nodeThColumn,(double)node->nodeTh);
+  writeSourceNode(f,node->children[first],depth+1,outputs,hotFirst);
+  for(uint32_t i=0;i<depth;i++)fputs("    ",f);
+  fputs("}else{\n",f);
+  writeSourceNode(f,node->children[1-first],depth+1,outputs,hotFirst);
+  for(uint32_t i=0;i<depth;i++)fputs("    ",f);
+  fputs("}\n",f);
+}
+
+static bool writeSource(const char* path, Classifier* clf, uint32_t features, bool hotFirst){
+  FILE* f = fopen(path,"w");
+  if(f==NULL)return false;
+  fputs("// Generated by the TinyDecisionTreeClassifier linuxTrainer\n",f);
+  fputs("#ifndef TINY_TREE_MODEL_H\n#define TINY_TREE_MODEL_H\n#include <stdint.h>\n\n",f);
+  fprintf(f,"#define TINY_TREE_FEATURES %u\n#define TINY_TREE_OUTPUTS %u\n\n",features,clf->outputs);
+  fputs("static inline void tinyTreePredict(const float* X, uint8_t* Y){\n",f);
+  writeSourceNode(f,clf->root,1,clf->outputs,hotFirst);
+  fputs("}\n\n#endif\n",f);
+  return fclose(f)==0;
+}
+
+static bool writeBinary(const char* path, Classifier* clf, size_t* size){
+  *size = clf->exportModel(NULL,0);
+  uint8_t* buffer = (uint8_t*)malloc(*size);
+  if(buffer==NULL || clf->exportModel(buffer,*size)!=*size){
+    free(buffer);
+    return false;
+  }
+  FILE* f = fopen(path,"wb");
+  bool ok = f!=NULL && fwrite(buffer,1,*size,f)==*size;
+  if(f!=NULL && fclose(f)!=0)ok = false;
+  free(buffer);
+  return ok;
+}
+
+static uint8_t* readFile(const char* path, size_t* size){
+  FILE* f = fopen(path,"rb");
+  if(f==NULL)return NULL;
+  uint8_t* buffer = NULL;
+  if(fseek(f,0,SEEK_END)==0){
+    long end = ftell(f);
+    if(end>0 && fseek(f,0,SEEK_SET)==0){
+      buffer = (uint8_t*)malloc(end);
+      if(buffer!=NULL && fread(buffer,1,end,f)!=(size_t)end){
+        free(buffer);
+        buffer = NULL;
+      }
+      *size = end;
+    }
+  }
+  fclose(f);
+  return buffer;
+}
+
+//Encodes the model just written against the base model, the device patches its copy of the base with it
+static bool writeDelta(const char* basePath, const char* modelPath, size_t* size){
+  size_t baseSize = 0;
+  size_t modelSize = 0;
+  uint8_t* base = readFile(basePath,&baseSize);
+  uint8_t* model = readFile(modelPath,&modelSize);
+  uint8_t* delta = NULL;
+  bool ok = false;
+  if(base!=NULL && model!=NULL){
+    *size = TinyModelDelta::diff(base,baseSize,model,modelSize,NULL,0);
+    delta = (uint8_t*)malloc(*size ? *size : 1);
+    if(*size!=0 && delta!=NULL && TinyModelDelta::diff(base,baseSize,model,modelSize,delta,*size)==*size){
+      char path[4096];
+      snprintf(path,sizeof(path),"%s.delta",modelPath);
+      FILE* f = fopen(path,"wb");
+      ok = f!=NULL && fwrite(delta,1,*size,f)==*size;
+      if(f!=NULL && fclose(f)!=0)ok = false;
+    }
+  }
+  free(delta);
+  free(model);
+  free(base);
+  return ok;
+}
+
+static void usage(void){
+  fprintf(stderr,"Usage: linuxTrainer [-c features] [-y outputs] [-f csv|bin] [-H] [-d depth] [-s minSplit] [-m maxFeatures] [-r splits] [-S subsample] [-t testFraction] [-k costs] [-l penalty] [-p alpha] [-C] [-P] [-o model] [-F source|bin] [-D base] dataset\n");
+}
+
+int main(int argc, char** argv){
+  static const struct option options[] = {
+    {"features",required_argument,NULL,'c'},
+    {"outputs",required_argument,NULL,'y'},
+    {"format",required_argument,NULL,'f'},
+    {"header",no_argument,NULL,'H'},
+    {"depth",required_argument,NULL,'d'},
+    {"min-split",required_argument,NULL,'s'},
+    {"max-features",required_argument,NULL,'m'},
+    {"random",required_argument,NULL,'r'},
+    {"subsample",required_argument,NULL,'S'},
+    {"test",required_argument,NULL,'t'},
+    {"costs",required_argument,NULL,'k'},
+    {"cost-penalty",required_argument,NULL,'l'},
+    {"prune",required_argument,NULL,'p'},
+    {"compact",no_argument,NULL,'C'},
+    {"profile",no_argument,NULL,'P'},
+    {"output",required_argument,NULL,'o'},
+    {"model",required_argument,NULL,'F'},
+    {"delta",required_argument,NULL,'D'},
+    {NULL,0,NULL,0}
+  };
+  uint32_t features = 0;
+  uint16_t outputs = 1;
+  const char* format = NULL;
+  bool header = false;
+  uint16_t maxDepth = 8;
+  uint16_t minSamplesSplit = 2;
+  uint16_t maxFeatures = DTR_MAX_FEATURES_ALL;
+  uint8_t randomSplits = 0;
+  uint32_t subsample = 0;
+  float testFraction = 0.2f;
+  const char* costList = NULL;
+  float costPenalty = 0;
+  float alpha = -1;
+  bool compact = false;
+  bool profile = false;
+  const char* output = NULL;
+  const char* modelFormat = NULL;
+  const char* deltaBase = NULL;
+  int c;
+  while((c = getopt_long(argc,argv,"c:y:f:Hd:s:m:r:S:t:k:l:p:CPo:F:D:",options,NULL))!=-1){
+    switch(c){
+      case 'c': features = atoi(optarg); break;
+      case 'y': outputs = atoi(optarg); break;
+      case 'f': format = optarg; break;
+      case 'H': header = true; break;
+      case 'd': maxDepth = atoi(optarg); break;
+      case 's': minSamplesSplit = atoi(optarg); break;
+      case 'm':
+        if(strcmp(optarg,"sqrt")==0)maxFeatures = DTR_MAX_FEATURES_SQRT;
+        else if(strcmp(optarg,"log2")==0)maxFeatures = DTR_MAX_FEATURES_LOG2;
+        else maxFeatures = atoi(optarg);
+        break;
+      case 'r': randomSplits = atoi(optarg); break;
+      case 'S': subsample = atoi(optarg); break;
+      case 't': testFraction = atof(optarg); break;
+      case 'k': costList = optarg; break;
+      case 'l': costPenalty = atof(optarg); break;
+      case 'p': alpha = atof(optarg); break;
+      case 'C': compact = true; break;
+      case 'P': profile = true; break;
+      case 'o': output = optarg; break;
+      case 'F': modelFormat = optarg; break;
+      case 'D': deltaBase = optarg; break;
+      default: usage(); return 1;
+    }
+  }
+  if(optind!=argc-1 || outputs==0 || testFraction<0 || testFraction>=1){
+    usage();
+    return 1;
+  }
+  const char* path = argv[optind];
+  bool binary = format ? strcmp(format,"bin")==0 : endsWith(path,".bin");
+
+  double t0 = now();
+  int fd = open(path,O_RDONLY);
+  struct stat st;
+  if(fd<0 || fstat(fd,&st)!=0 || st.st_size==0){
+    fprintf(stderr,"Can't open %s\n",path);
+    return 1;
+  }
+  const char* data = (const char*)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  if(data==MAP_FAILED){
+    fprintf(stderr,"Can't map %s\n",path);
+    return 1;
+  }
+  madvise((void*)data,st.st_size,MADV_SEQUENTIAL);
+  Dataset d;
+  memset(&d,0,sizeof(d));
+  d.outputs = outputs;
+  bool loaded = binary ? loadBinary(data,st.st_size,features,&d) : loadCsv(data,st.st_size,header,features,&d);
+  if(!loaded)return 1;
+  //CSV values were copied out, the map isn't needed anymore
+  if(!binary)munmap((void*)data,st.st_size);
+  double loadTime = now()-t0;
+
+  //Random holdout that keeps the file order of both parts, the split search reads the rows in about the order they are in memory
+  Treetype** X = (Treetype**)malloc((size_t)d.rows*sizeof(Treetype*));
+  Labeltype** Y = (Labeltype**)malloc((size_t)d.rows*sizeof(Labeltype*));
+  if(X==NULL || Y==NULL){
+    fprintf(stderr,"Not enough memory for %u rows\n",d.rows);
+    return 1;
+  }
+  uint32_t trainRows = 0;
+  uint32_t testRows = 0;
+  uint32_t state = 1;
+  uint32_t testThreshold = (uint32_t)(testFraction*4294967295.0);
+  for(uint32_t i=0;i<d.rows;i++){
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    if(state<testThreshold)testRows++;
+  }
+  trainRows = d.rows-testRows;
+  uint32_t train = 0;
+  uint32_t test = trainRows;
+  state = 1;
+  for(uint32_t i=0;i<d.rows;i++){
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    uint32_t k = state<testThreshold ? test++ : train++;
+    X[k] = d.X[i];
+    Y[k] = d.Y[i];
+  }
+
+  float* costs = NULL;
+  if(costList){
+    costs = (float*)malloc(d.features*sizeof(float));
+    const char* p = costList;
+    for(uint32_t i=0;i<d.features;i++){
+      char* end;
+      costs[i] = strtof(p,&end);
+      if(end==p){
+        fprintf(stderr,"--costs needs %u values\n",d.features);
+        return 1;
+      }
+      p = *end==',' ? end+1 : end;
+    }
+  }
+
+  Classifier clf(maxDepth,minSamplesSplit);
+  clf.featureCosts = costs;
+  clf.costPenalty = costPenalty;
+  clf.maxFeatures = maxFeatures;
+  if(randomSplits){
+    clf.splitMode = DTR_SPLIT_RANDOM;
+    clf.randomSplitsPerFeature = randomSplits;
+  }
+  if(subsample){
+    clf.subsampleThreshold = subsample;
+    clf.subsampleSize = subsample/4;
+  }
+  t0 = now();
+  clf.fit(X,Y,trainRows,d.features,outputs);
+  double fitTime = now()-t0;
+  if(!clf.trained){
+    fprintf(stderr,"Training failed\n");
+    return 1;
+  }
+  size_t peakBytes = clf.allocator.peakBytes;
+  uint32_t nodes = clf.countNodes(clf.root);
+
+  t0 = now();
+  if(alpha>=0)clf.pruneCostComplexity(X,Y,trainRows,alpha);
+  uint32_t nodesAfter = clf.countNodes(clf.root);
+  if(compact)clf.compact(NULL,&nodesAfter);
+  double postTime = now()-t0;
+
+  t0 = now();
+  if(profile){
+    if(clf.beginProfile()!=0){
+      fprintf(stderr,"Not enough memory for the profile\n");
+      return 1;
+    }
+    for(uint32_t i=0;i<trainRows;i++)clf.predict(X[i]);
+    clf.relayout();
+    clf.endProfile();
+  }
+  double profileTime = now()-t0;
+
+  t0 = now();
+  float trainScore = clf.score(X,Y,trainRows);
+  float testScore = testRows ? clf.score(X+trainRows,Y+trainRows,testRows) : 0;
+  double scoreTime = now()-t0;
+
+  printf("Dataset:     %u rows, %u features, %u outputs (%u train, %u test)\n",d.rows,d.features,outputs,trainRows,testRows);
+  printf("Load:        %.3f s\n",loadTime);
+  printf("Fit:         %.3f s, peak %zu bytes, %u nodes\n",fitTime,peakBytes,nodes);
+  if(alpha>=0 || compact)printf("Prune/merge: %.3f s, %u nodes\n",postTime,nodesAfter);
+  if(profile)printf("Profile:     %.3f s\n",profileTime);
+  printf("Tree:        %zu bytes\n",clf.allocator.currentBytes);
+  printf("Accuracy:    %.4f train",trainScore);
+  if(testRows)printf(", %.4f test",testScore);
+  printf(" (%.0f predictions/s)\n",(trainRows+testRows)/(scoreTime>0 ? scoreTime : 1e-9));
+  if(costs)printf("Cost:        %.4f per prediction\n",clf.expectedFeatureCost(X,trainRows));
+  else printf("Features:    %.2f per prediction\n",clf.expectedFeatureCost(X,trainRows));
+
+  if(output){
+    bool binaryModel = modelFormat ? strcmp(modelFormat,"bin")==0 : endsWith(output,".bin");
+    size_t size = 0;
+    bool ok = binaryModel ? writeBinary(output,&clf,&size) : writeSource(output,&clf,d.features,profile);
+    if(!ok){
+      fprintf(stderr,"Can't write %s\n",output);
+      return 1;
+    }
+    if(binaryModel)printf("Model:       %s, %zu bytes\n",output,size);
+    else printf("Model:       %s\n",output);
+    if(deltaBase){
+      size_t deltaSize = 0;
+      if(!binaryModel || !writeDelta(deltaBase,output,&deltaSize)){
+        fprintf(stderr,"Can't write the delta against %s (it needs a binary model and a binary base)\n",deltaBase);
+        return 1;
+      }
+      printf("Delta:       %s.delta, %zu bytes\n",output,deltaSize);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,167 @@
+/* TinyDecisionTreeClassifier library
+ * Copyright (c) 2023-2024 Aleksei Karavaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DECISION_TREE_ALLOCATORS_H
+#define DECISION_TREE_ALLOCATORS_H
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* An allocator policy is any class with the following methods:
+ *   void* allocate(size_t size);
+ *   void* reallocate(void* ptr, size_t oldSize, size_t newSize);
+ *   void deallocate(void* ptr, size_t size);
+ * The classifier passes the block size back on every call, so policies don't have to store headers.
+ */
+
+/** @brief Default allocator policy, forwards everything to malloc/realloc/free.**/
+class TinyMallocAllocator{
+    public:
+    void* allocate(size_t size){
+        return malloc(size);
+    }
+    void* reallocate(void* ptr, size_t oldSize, size_t newSize){
+        (void)oldSize;
+        return realloc(ptr,newSize);
+    }
+    void deallocate(void* ptr, size_t size){
+        (void)size;
+        free(ptr);
+    }
+};
+
+/** @brief Bump allocator working on top of a user supplied buffer (static pool, PSRAM region, etc).
+ * Only the most recent block is really returned on deallocate, everything else is returned by reset().
+ * Blocks are aligned to the size of a pointer.
+ **/
+class TinyArenaAllocator{
+    public:
+    uint8_t* buffer=NULL;
+    size_t capacity=0;
+    size_t used=0;
+
+    TinyArenaAllocator(){}
+
+    /** @brief The class constructor.
+     * @param buffer Memory the arena hands out.
+     * @param capacity Size of the buffer in bytes.
+    **/
+    TinyArenaAllocator(void* buffer, size_t capacity){
+        setBuffer(buffer,capacity);
+    }
+
+    /** @brief Sets the memory the arena hands out and drops everything allocated before.
+     * @param buffer Memory the arena hands out.
+     * @param capacity Size of the buffer in bytes.
+    **/
+    void setBuffer(void* buffer, size_t capacity){
+        this->buffer=(uint8_t*)buffer;
+        this->capacity=capacity;
+        used=0;
+    }
+
+    /** @brief Forgets all the allocations at once.**/
+    void reset(void){
+        used=0;
+    }
+
+    void* allocate(size_t size){
+        size_t aligned = align(size);
+        if(buffer==NULL || aligned>capacity-used)return NULL;
+        void* ptr = buffer+used;
+        used+=aligned;
+        return ptr;
+    }
+
+    void* reallocate(void* ptr, size_t oldSize, size_t newSize){
+        if(ptr==NULL)return allocate(newSize);
+        if(isLast(ptr,oldSize)){
+            size_t start = (uint8_t*)ptr-buffer;
+            if(align(newSize)>capacity-start)return NULL;
+            used=start+align(newSize);
+            return ptr;
+        }
+        void* newPtr = allocate(newSize);
+        if(newPtr==NULL)return NULL;
+        memcpy(newPtr,ptr,oldSize<newSize ? oldSize : newSize);
+        return newPtr;
+    }
+
+    void deallocate(void* ptr, size_t size){
+        if(ptr!=NULL && isLast(ptr,size)){
+            used=(uint8_t*)ptr-buffer;
+        }
+    }
+
+    private:
+    static size_t align(size_t size){
+        return (size+sizeof(void*)-1)&~(sizeof(void*)-1);
+    }
+
+    bool isLast(void* ptr, size_t size){
+        return (uint8_t*)ptr+align(size)==buffer+used;
+    }
+};
+
+/** @brief Wraps another allocator policy and keeps track of the memory usage.
+ * The template Inner is the allocator policy that really provides the memory.
+ **/
+template <typename Inner = TinyMallocAllocator>
+class TinyCountingAllocator : public Inner{
+    public:
+    using Inner::Inner;
+
+    /** @brief Bytes currently allocated.**/
+    size_t currentBytes=0;
+    /** @brief Maximum of currentBytes since the creation or the last resetStats().**/
+    size_t peakBytes=0;
+    /** @brief Number of successful allocate/reallocate calls.**/
+    uint32_t allocations=0;
+
+    /** @brief Clears the peak and the allocation counter, the current usage stays as is.**/
+    void resetStats(void){
+        peakBytes=currentBytes;
+        allocations=0;
+    }
+
+    void* allocate(size_t size){
+        void* ptr = Inner::allocate(size);
+        if(ptr!=NULL)grow(0,size);
+        return ptr;
+    }
+
+    void* reallocate(void* ptr, size_t oldSize, size_t newSize){
+        void* newPtr = Inner::reallocate(ptr,oldSize,newSize);
+        if(newPtr!=NULL)grow(ptr==NULL ? 0 : oldSize,newSize);
+        return newPtr;
+    }
+
+    void deallocate(void* ptr, size_t size){
+        if(ptr==NULL)return;
+        Inner::deallocate(ptr,size);
+        currentBytes-=size;
+    }
+
+    private:
+    void grow(size_t oldSize, size_t newSize){
+        currentBytes=currentBytes-oldSize+newSize;
+        if(currentBytes>peakBytes)peakBytes=currentBytes;
+        allocations++;
+    }
+};
+
+#endif
@@ -18,224 +18,1966 @@
 #define DECISION_TREE_CLASSIFIER_CPP
 #include "TinyDecisionTreeClassifier.h"
 
-template < typename T >
-TinyDecisionTreeClassifier<T>::TinyDecisionTreeClassifier(uint16_t maxDepth, uint16_t minSamplesSplit){
+template < typename TFeature, typename TLabel, typename Allocator >
+TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::TinyDecisionTreeClassifier(uint16_t maxDepth, uint16_t minSamplesSplit){
     this->maxDepth=maxDepth;
     this->minSamplesSplit=minSamplesSplit;
 };
 
-// number of rows is the same for both
-template < typename T >
-void TinyDecisionTreeClassifier<T>::fit(T** X,T** Y, uint32_t rows,uint32_t cols){
+template < typename TFeature, typename TLabel, typename Allocator >
+TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::~TinyDecisionTreeClassifier(){
+    cancelFit();
     if(trained){
-        root->cleanup();
-        delete root;   
+        releaseNode(root);
+        trained=false;
+    }
+    releaseBlock();
+    releaseFreeNodes();
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::TinyDecisionTreeClassifier(TinyDecisionTreeClassifier&& other){
+    moveFrom(other);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>& TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::operator=(TinyDecisionTreeClassifier&& other){
+    if(this!=&other){
+        //Our nodes belong to our allocator, they are freed before it is replaced
+        cancelFit();
+        if(trained){
+            releaseNode(root);
+            trained=false;
+        }
+        releaseBlock();
+        releaseFreeNodes();
+        moveFrom(other);
+    }
+    return *this;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::moveFrom(TinyDecisionTreeClassifier& other){
+    other.cancelFit();
+    maxDepth=other.maxDepth;
+    minSamplesSplit=other.minSamplesSplit;
+    maxFeatures=other.maxFeatures;
+    subsampleThreshold=other.subsampleThreshold;
+    subsampleSize=other.subsampleSize;
+    splitMode=other.splitMode;
+    randomSplitsPerFeature=other.randomSplitsPerFeature;
+    randomSeed=other.randomSeed;
+    collapseDuplicates=other.collapseDuplicates;
+    reuseNodes=other.reuseNodes;
+    featureCosts=other.featureCosts;
+    costPenalty=other.costPenalty;
+    allocator=other.allocator;
+    other.allocator=Allocator();
+    trained=other.trained;
+    root=other.root;
+    outputs=other.outputs;
+    columns=other.columns;
+    freeNodes=other.freeNodes;
+    freeNodesCount=other.freeNodesCount;
+    nodeBlock=other.nodeBlock;
+    nodeBlockSize=other.nodeBlockSize;
+    branchCounts=other.branchCounts;
+    other.trained=false;
+    other.root=NULL;
+    other.freeNodes=NULL;
+    other.freeNodesCount=0;
+    other.nodeBlock=NULL;
+    other.nodeBlockSize=0;
+    other.branchCounts=NULL;
+    //The nodes point back to their classifier
+    if(trained)root->adopt(this);
+    for(Node* node=freeNodes;node!=NULL;node=node->children[0]){
+        node->tree = this;
+    }
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::releaseFreeNodes(void){
+    size_t freed = 0;
+    while(freeNodes!=NULL){
+        Node* node = freeNodes;
+        freeNodes = node->children[0];
+        freed += destroyNode(node);
+    }
+    freeNodesCount = 0;
+    return freed;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::recycleNode(Node* node){
+    if(--node->parents!=0)return;
+    if(node->children[0]!=NULL){
+        recycleNode(node->children[0]);
+        recycleNode(node->children[1]);
+    }
+    if(inBlock(node)){
+        destroyNode(node);
+        return;
+    }
+    node->children[0] = freeNodes;
+    freeNodes = node;
+    freeNodesCount++;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::dropTree(void){
+    if(!trained)return;
+    if(reuseNodes)recycleNode(root);
+    else releaseNode(root);
+    trained=false;
+    releaseBlock();
+}
+
+// number of rows is the same for both
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::fit(TFeature** X,TLabel** Y, uint32_t rows,uint32_t cols,uint16_t outputs,const uint32_t* weights){
+    if(beginFit(X,Y,rows,cols,outputs,weights)!=0)return;
+    while(!isDone())step(0xFFFFFFFF);
+};
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::beginFit(TFeature** X,TLabel** Y, uint32_t rows,uint32_t cols,uint16_t outputs,const uint32_t* weights){
+    cancelFit();
+    dropTree();
+    if(rows==0)return 0;
+    typename Node::RowsSubIndexes rootRsi;
+    int16_t rslt = beginIndexes(rows,weights,collapseDuplicates,&rootRsi);
+    if(rslt!=0)return rslt;
+    if(collapseDuplicates)collapseRows(X,Y,&rootRsi,rowWeights,cols,outputs);
+    presortedStride = 0;
+    return beginRows(X,Y,rows,&rootRsi,cols,outputs);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::fit(const TinySparseRows<TFeature>& X,TLabel** Y, uint32_t rows,uint32_t cols,uint16_t outputs,const uint32_t* weights){
+    cancelFit();
+    dropTree();
+    if(rows==0)return;
+    typename Node::RowsSubIndexes rootRsi;
+    if(beginIndexes(rows,weights,false,&rootRsi)!=0)return;
+    presortedStride = 0;
+    //getBestSplit reads the samples from fitSparse, there is no dense X
+    fitSparse = X;
+    if(beginRows(NULL,Y,rows,&rootRsi,cols,outputs)==0){
+        while(!isDone())step(0xFFFFFFFF);
+    }
+    fitSparse.rowStart = NULL;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::beginIndexes(uint32_t rows, const uint32_t* weights, bool weighted, typename Node::RowsSubIndexes* rsi){
+    rsi->size = rows;
+    rsi->indexes = (uint32_t *)allocator.allocate(rows*sizeof(uint32_t));
+    if(rsi->indexes==NULL)return NOT_ENOUGH_MEMORY;
+    for(uint32_t i=0;i<rows;i++){
+        rsi->indexes[i]=i;
+    }
+    fitIndexes = rsi->indexes;
+    fitRowsCount = rows;
+    if(weights!=NULL || weighted){
+        rowWeights = (uint32_t *)allocator.allocate(rows*sizeof(uint32_t));
+        if(rowWeights==NULL){
+            endFit();
+            return NOT_ENOUGH_MEMORY;
+        }
+        for(uint32_t i=0;i<rows;i++){
+            rowWeights[i] = weights ? weights[i] : 1;
+        }
+    }
+    return 0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+bool TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::collapseRows(TFeature** X,TLabel** Y, typename Node::RowsSubIndexes* rsi, uint32_t* weights, uint32_t cols, uint16_t outputs){
+    uint32_t tableSize = 2;
+    while(tableSize<2*rsi->size)tableSize<<=1;
+    uint32_t mask = tableSize-1;
+    uint32_t* table = (uint32_t *)allocator.allocate(tableSize*sizeof(uint32_t));
+    if(table==NULL)return false;
+    for(uint32_t i=0;i<tableSize;i++)table[i]=0;
+
+    //Rows are compared byte by byte, the table keeps the first row of every group (plus one, 0 is an empty slot)
+    uint32_t distinct = 0;
+    for(uint32_t i=0;i<rsi->size;i++){
+        uint32_t row = rsi->indexes[i];
+        uint32_t h = 2166136261u;
+        const uint8_t* bytes = (const uint8_t*)X[row];
+        for(uint32_t k=0;k<cols*sizeof(TFeature);k++)h = (h^bytes[k])*16777619u;
+        bytes = (const uint8_t*)Y[row];
+        for(uint32_t k=0;k<outputs*sizeof(TLabel);k++)h = (h^bytes[k])*16777619u;
+        uint32_t slot = h&mask;
+        while(table[slot]!=0){
+            uint32_t other = table[slot]-1;
+            if(memcmp(X[other],X[row],cols*sizeof(TFeature))==0 && memcmp(Y[other],Y[row],outputs*sizeof(TLabel))==0)break;
+            slot = (slot+1)&mask;
+        }
+        if(table[slot]==0){
+            table[slot]=row+1;
+            rsi->indexes[distinct++]=row;
+        }else{
+            weights[table[slot]-1]+=weights[row];
+        }
+    }
+    rsi->size = distinct;
+    allocator.deallocate(table,tableSize*sizeof(uint32_t));
+    return true;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::fitPresorted(TFeature** X,TLabel** Y, uint32_t rows, uint32_t* sorted, uint32_t n, uint32_t cols,uint16_t outputs){
+    cancelFit();
+    dropTree();
+    //The lists of all the columns are partitioned the same way, so a node is the same subrange of each of them
+    typename Node::RowsSubIndexes rootRsi;
+    rootRsi.size = n;
+    rootRsi.indexes = sorted;
+    fitRowsCount = rows;
+    presortedStride = n;
+    if(beginRows(X,Y,rows,&rootRsi,cols,outputs)==0){
+        while(!isDone())step(0xFFFFFFFF);
+    }
+    presortedStride = 0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::beginRows(TFeature** X,TLabel** Y, uint32_t rows, typename Node::RowsSubIndexes* rsi, uint32_t cols,uint16_t outputs){
+    if(rsi->size==0 || outputs==0){
+        endFit();
+        return 0;
+    }
+    //The recycled nodes keep decisions arrays of the old size
+    if(outputs!=this->outputs)releaseFreeNodes();
+    this->outputs=outputs;
+    randomState = randomSeed ? randomSeed : 1;
+    root = createNode();
+    if(root==NULL){
+        endFit();
+        return NOT_ENOUGH_MEMORY;
+    }
+    if(!encodeClasses(Y,rows)){
+        destroyNode(root);
+        endFit();
+        return NOT_ENOUGH_MEMORY;
+    }
+    //With maxDepth the stack never holds more than maxDepth nodes, one pending sibling per level
+    frontierCapacity = maxDepth ? maxDepth+1 : 16;
+    frontier = (FitTask *)allocator.allocate(frontierCapacity*sizeof(FitTask));
+    if(frontier==NULL){
+        releaseClasses(rows);
+        destroyNode(root);
+        endFit();
+        return NOT_ENOUGH_MEMORY;
+    }
+    frontier[0].node = root;
+    frontier[0].rsi = *rsi;
+    frontier[0].depth = 1;
+    frontierSize = 1;
+    fitX = X;
+    fitCols = cols;
+    columns = cols;
+    fitOutOfMemory = false;
+    fitting = true;
+    return 0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+bool TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::reserveFrontier(void){
+    if(frontierSize+2<=frontierCapacity)return true;
+    FitTask* grown = (FitTask *)allocator.reallocate(frontier,frontierCapacity*sizeof(FitTask),2*frontierCapacity*sizeof(FitTask));
+    if(grown==NULL)return false;
+    frontier = grown;
+    frontierCapacity *= 2;
+    return true;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::step(uint32_t maxNodes){
+    uint32_t expanded = 0;
+    while(fitting && frontierSize>0 && expanded<maxNodes){
+        FitTask task = frontier[--frontierSize];
+        typename Node::RowsSubIndexes rsiBelowTh;
+        typename Node::RowsSubIndexes rsiAboveTh;
+        Node* node = task.node;
+        if(node->expand(fitX,&task.rsi,fitCols,task.depth,&rsiBelowTh,&rsiAboveTh)){
+            if(reserveFrontier()){
+                //children[0] goes on top, so it is expanded first
+                frontier[frontierSize].node = node->children[1];
+                frontier[frontierSize].rsi = rsiAboveTh;
+                frontier[frontierSize].depth = task.depth+1;
+                frontierSize++;
+                frontier[frontierSize].node = node->children[0];
+                frontier[frontierSize].rsi = rsiBelowTh;
+                frontier[frontierSize].depth = task.depth+1;
+                frontierSize++;
+            }else{
+                node->cleanup();
+                node->thReady = false;
+                node->decisionReady = true;
+            }
+        }else if(fitOutOfMemory){
+            //The nodes left on the frontier are empty leaves, the tree is released below
+            frontierSize = 0;
+        }
+        expanded++;
+    }
+    if(fitting && frontierSize==0){
+        allocator.deallocate(frontier,frontierCapacity*sizeof(FitTask));
+        frontier = NULL;
+        releaseClasses(fitRowsCount);
+        trained = true;
+        endFit();
+        if(fitOutOfMemory)dropTree();
+    }
+    return expanded;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+bool TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::isDone(void){
+    return !fitting;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::cancelFit(void){
+    if(!fitting)return;
+    //The nodes left on the frontier are empty leaves, the tree can be released as it is
+    frontierSize = 0;
+    step(0);
+    dropTree();
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::endFit(void){
+    if(rowWeights){
+        allocator.deallocate(rowWeights,fitRowsCount*sizeof(uint32_t));
+        rowWeights=NULL;
+    }
+    if(fitIndexes){
+        allocator.deallocate(fitIndexes,fitRowsCount*sizeof(uint32_t));
+        fitIndexes=NULL;
+    }
+    frontierSize=0;
+    fitting=false;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+bool TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::encodeClasses(TLabel** Y, uint32_t rows){
+    //1-byte labels have at most 256 classes and are mapped with a lookup table, the others are sorted
+    bool direct = (TinySortRadixKey<TLabel>::bytes==1);
+    classLabelsCapacity = (direct && rows>256 ? 256 : rows)*outputs;
+    classOffsets = (uint32_t *)allocator.allocate((outputs+1)*sizeof(uint32_t));
+    rowClasses = (uint16_t *)allocator.allocate(rows*outputs*sizeof(uint16_t));
+    classLabels = (TLabel *)allocator.allocate(classLabelsCapacity*sizeof(TLabel));
+    if(classOffsets==NULL || rowClasses==NULL || classLabels==NULL){
+        if(classLabels)allocator.deallocate(classLabels,classLabelsCapacity*sizeof(TLabel));
+        if(rowClasses)allocator.deallocate(rowClasses,rows*outputs*sizeof(uint16_t));
+        if(classOffsets)allocator.deallocate(classOffsets,(outputs+1)*sizeof(uint32_t));
+        return false;
+    }
+    uint16_t* lookup = NULL;
+    if(direct){
+        //classLabels only has room for 256 labels per output, the sort can't be used instead
+        lookup = (uint16_t *)allocator.allocate(256*sizeof(uint16_t));
+        if(lookup==NULL){
+            releaseClasses(rows);
+            return false;
+        }
+    }
+    //The unique labels of every output are packed in ascending order to the front of the buffer, which is then shrunk
+    totalClasses=0;
+    for(uint16_t o=0;o<outputs;o++){
+        TLabel* labels = classLabels+totalClasses;
+        uint32_t classes=0;
+        if(direct){
+            for(uint16_t k=0;k<256;k++)lookup[k]=0;
+            for(uint32_t i=0;i<rows;i++){
+                lookup[TinySortRadixKey<TLabel>::get(Y[i][o])]=1;
+            }
+            for(uint16_t k=0;k<256;k++){
+                if(lookup[k]==0)continue;
+                lookup[k]=classes;
+                labels[classes++]=TinySortRadixKey<TLabel>::restore(k);
+            }
+            for(uint32_t i=0;i<rows;i++){
+                rowClasses[i*outputs+o]=lookup[TinySortRadixKey<TLabel>::get(Y[i][o])];
+            }
+        }else{
+            for(uint32_t i=0;i<rows;i++){
+                labels[i]=Y[i][o];
+            }
+            TinySort<TLabel>::sort(labels,rows,&allocator);
+            classes=1;
+            for(uint32_t i=1;i<rows;i++){
+                if(labels[i]!=labels[classes-1])labels[classes++]=labels[i];
+            }
+        }
+        classOffsets[o]=totalClasses;
+        totalClasses+=classes;
+    }
+    classOffsets[outputs]=totalClasses;
+    if(lookup)allocator.deallocate(lookup,256*sizeof(uint16_t));
+    TLabel* shrunk = (TLabel *)allocator.reallocate(classLabels,classLabelsCapacity*sizeof(TLabel),totalClasses*sizeof(TLabel));
+    if(shrunk!=NULL){
+        classLabels=shrunk;
+        classLabelsCapacity=totalClasses;
+    }
+    if(direct)return true;
+
+    for(uint16_t o=0;o<outputs;o++){
+        //The class of a row is stored in 16 bits
+        if(classOffsets[o+1]-classOffsets[o]>0xFFFF){
+            releaseClasses(rows);
+            return false;
+        }
+    }
+    for(uint32_t i=0;i<rows;i++){
+        for(uint16_t o=0;o<outputs;o++){
+            TLabel* labels = classLabels+classOffsets[o];
+            uint32_t lo = 0;
+            uint32_t hi = classOffsets[o+1]-classOffsets[o]-1;
+            while(lo<hi){
+                uint32_t mid = (lo+hi)/2;
+                if(labels[mid]<Y[i][o])lo=mid+1;
+                else hi=mid;
+            }
+            rowClasses[i*outputs+o]=lo;
+        }
+    }
+    return true;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::releaseClasses(uint32_t rows){
+    allocator.deallocate(classLabels,classLabelsCapacity*sizeof(TLabel));
+    allocator.deallocate(rowClasses,rows*outputs*sizeof(uint16_t));
+    allocator.deallocate(classOffsets,(outputs+1)*sizeof(uint32_t));
+    classLabels=NULL;
+    rowClasses=NULL;
+    classOffsets=NULL;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+typename TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node* TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::createNode(void){
+    if(freeNodes!=NULL){
+        Node* node = freeNodes;
+        freeNodes = node->children[0];
+        freeNodesCount--;
+        TLabel* decisions = node->decisions;
+        node->init(this);
+        node->decisions = decisions;
+        return node;
+    }
+    Node* node = (Node*)allocator.allocate(sizeof(Node));
+    if(node!=NULL)node->init(this);
+    return node;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::destroyNode(Node* node){
+    size_t freed = 0;
+    if(node->decisions){
+        allocator.deallocate(node->decisions,outputs*sizeof(TLabel));
+        freed += outputs*sizeof(TLabel);
+    }
+    //The nodes of the block are freed all at once by releaseBlock
+    if(!inBlock(node)){
+        allocator.deallocate(node,sizeof(Node));
+        freed += sizeof(Node);
+    }
+    return freed;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::random(uint32_t n){
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState % n;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::featuresPerSplit(uint32_t cols){
+    uint32_t n;
+    if(maxFeatures==DTR_MAX_FEATURES_ALL)n=cols;
+    else if(maxFeatures==DTR_MAX_FEATURES_SQRT)n=(uint32_t)sqrt((float)cols);
+    else if(maxFeatures==DTR_MAX_FEATURES_LOG2)n=(uint32_t)(log((float)cols)/log(2.0f));
+    else n=maxFeatures;
+    if(n<1)n=1;
+    if(n>cols)n=cols;
+    return n;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::plot(void){
+    plot(root,0);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::plot(Node* node,uint32_t depth){
+    if(node->thReady){
+        for(uint32_t i=0;i<depth;i++){
+            DTR_DEBUG_PRINT("               ");
+        }
+        DTR_DEBUG_PRINT("if(X[");
+        DTR_DEBUG_PRINT(node->nodeThColumn);
+        DTR_DEBUG_PRINT("]<=");
+        DTR_DEBUG_PRINT(node->nodeTh);
+        DTR_DEBUG_PRINTLN(")");
+    }
+    if(node->decisionReady){
+        for(uint32_t i=0;i<depth;i++){
+            DTR_DEBUG_PRINT("               ");
+        }
+        DTR_DEBUG_PRINT("Y=(");
+        if(node->decisions){
+            for(uint16_t o=0;o<outputs;o++){
+                if(o){DTR_DEBUG_PRINT(",");}
+                DTR_DEBUG_PRINT(node->decisions[o]);
+            }
+        }else{
+            DTR_DEBUG_PRINT(node->decision);
+        }
+        DTR_DEBUG_PRINTLN(")");
+    }
+    
+    if(node->children[0]!=NULL){
+        for(uint16_t i=0;i<2;i++){
+            plot(node->children[i],depth+1);
+        }
+    }
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+TLabel TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::predict(TFeature* X){
+    if(!trained)return 0;
+    if(branchCounts!=NULL){
+        Node* leaf = profiledLeaf(X);
+        return leaf->decisionReady ? leaf->decision : 0;
+    }
+    return root->decide(X);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+typename TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node* TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::findNode(TFeature* X, uint16_t depth){
+    Node* node = root;
+    for(uint16_t d=1;!node->decisionReady && d!=depth;d++){
+        if(!node->thReady || node->children[0]==NULL)return NULL;
+        node = node->children[X[node->nodeThColumn]<=node->nodeTh ? 0 : 1];
+    }
+    return node;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::predict(TFeature* X,TLabel* Y){
+    for(uint16_t o=0;o<outputs;o++)Y[o]=0;
+    if(!trained)return;
+    Node* node = branchCounts!=NULL ? profiledLeaf(X) : findNode(X,0);
+    if(node==NULL || !node->decisionReady)return;
+    if(node->decisions){
+        for(uint16_t o=0;o<outputs;o++)Y[o]=node->decisions[o];
+    }else{
+        Y[0]=node->decision;
+    }
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::releaseNode(Node* node){
+    if(--node->parents!=0)return 0;
+    size_t freed = node->cleanup();
+    return freed+destroyNode(node);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::countNodes(Node* node){
+    if(node->children[0]==NULL)return 1;
+    return 1+countNodes(node->children[0])+countNodes(node->children[1]);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::compact(uint32_t* nodesBefore, uint32_t* nodesAfter){
+    if(!trained)return 0;
+    uint32_t before = countNodes(root);
+    if(nodesBefore)*nodesBefore=before;
+    if(nodesAfter)*nodesAfter=before;
+    uint32_t size = 2;
+    while(size<2*before)size<<=1;
+    Node** table = (Node**)allocator.allocate(size*sizeof(Node*));
+    if(table==NULL)return 0;
+    for(uint32_t i=0;i<size;i++){
+        table[i]=NULL;
+    }
+    uint32_t unique = 0;
+    size_t freed = 0;
+    root = compactNode(root,table,size-1,&unique,&freed);
+    allocator.deallocate(table,size*sizeof(Node*));
+    if(nodesAfter)*nodesAfter=unique;
+    return freed;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+typename TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node* TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::compactNode(Node* node, Node** table, uint32_t mask, uint32_t* unique, size_t* freed){
+    if(node->children[0]!=NULL){
+        //Bottom-up, so identical subtrees end up as the same child pointers
+        node->children[0] = compactNode(node->children[0],table,mask,unique,freed);
+        node->children[1] = compactNode(node->children[1],table,mask,unique,freed);
+        if(node->children[0]==node->children[1]){
+            //Both sides decide the same, the split is useless
+            Node* child = node->children[0];
+            child->parents++;
+            *freed += releaseNode(node);
+            return child;
+        }
+    }
+    uint32_t i = node->hash()&mask;
+    while(table[i]!=NULL){
+        if(table[i]==node)return node;
+        if(table[i]->sameAs(node)){
+            Node* same = table[i];
+            same->parents++;
+            *freed += releaseNode(node);
+            return same;
+        }
+        i = (i+1)&mask;
+    }
+    table[i] = node;
+    (*unique)++;
+    return node;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::numberNodes(Node* node, Node** table, uint32_t* numbers, uint32_t mask, Node** order, uint32_t* count){
+    uint32_t i = nodeSlot(node,table,mask);
+    if(table[i]==node)return numbers[i];
+    if(node->children[0]!=NULL){
+        numberNodes(node->children[0],table,numbers,mask,order,count);
+        numberNodes(node->children[1],table,numbers,mask,order,count);
+        //The children could have taken the slot
+        i = nodeSlot(node,table,mask);
+    }
+    table[i] = node;
+    numbers[i] = *count;
+    order[*count] = node;
+    return (*count)++;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::nodeSlot(Node* node, Node** table, uint32_t mask){
+    uint32_t i = ((uint32_t)(((uintptr_t)node)/sizeof(void*))*2654435761u)&mask;
+    while(table[i]!=NULL && table[i]!=node){
+        i = (i+1)&mask;
+    }
+    return i;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::exportModel(uint8_t* buffer, size_t size){
+    if(!trained)return 0;
+    uint32_t expanded = countNodes(root);
+    uint32_t tableSize = 2;
+    while(tableSize<2*expanded)tableSize<<=1;
+    Node** table = (Node**)allocator.allocate(tableSize*sizeof(Node*));
+    uint32_t* numbers = (uint32_t *)allocator.allocate(tableSize*sizeof(uint32_t));
+    Node** order = (Node**)allocator.allocate(expanded*sizeof(Node*));
+    size_t written = 0;
+    if(table!=NULL && numbers!=NULL && order!=NULL){
+        for(uint32_t i=0;i<tableSize;i++){
+            table[i]=NULL;
+        }
+        uint32_t count = 0;
+        numberNodes(root,table,numbers,tableSize-1,order,&count);
+        //The header promises every split column is below columns
+        uint32_t modelColumns = columns;
+        for(uint32_t n=0;n<count;n++){
+            if(order[n]->children[0]!=NULL && order[n]->nodeThColumn>=modelColumns)modelColumns = order[n]->nodeThColumn+1;
+        }
+        size_t recordSize = modelRecordSize();
+        written = DTR_MODEL_HEADER_SIZE+count*recordSize;
+        if(buffer!=NULL && size<written){
+            written = 0;
+        }else if(buffer!=NULL){
+            uint32_t magic = DTR_MODEL_MAGIC;
+            uint8_t header[DTR_MODEL_HEADER_SIZE];
+            memset(header,0,sizeof(header));
+            memcpy(header,&magic,4);
+            header[4] = sizeof(TFeature);
+            header[5] = ((TFeature)0.5)!=0 ? 1 : 0;
+            header[6] = sizeof(TLabel);
+            memcpy(header+8,&outputs,2);
+            memcpy(header+12,&count,4);
+            memcpy(header+16,&modelColumns,4);
+            memcpy(buffer,header,sizeof(header));
+            uint8_t* record = buffer+DTR_MODEL_HEADER_SIZE;
+            for(uint32_t n=0;n<count;n++){
+                Node* node = order[n];
+                uint32_t fields[3] = {DTR_MODEL_LEAF,0,0};
+                if(node->children[0]!=NULL){
+                    fields[0] = node->nodeThColumn;
+                    fields[1] = numbers[nodeSlot(node->children[0],table,tableSize-1)];
+                    fields[2] = numbers[nodeSlot(node->children[1],table,tableSize-1)];
+                }
+                memcpy(record,fields,sizeof(fields));
+                memcpy(record+sizeof(fields),&node->nodeTh,sizeof(TFeature));
+                uint8_t* decisionsRecord = record+sizeof(fields)+sizeof(TFeature);
+                if(node->decisions){
+                    memcpy(decisionsRecord,node->decisions,outputs*sizeof(TLabel));
+                }else{
+                    memcpy(decisionsRecord,&node->decision,sizeof(TLabel));
+                }
+                record += recordSize;
+            }
+        }
+    }
+    if(order)allocator.deallocate(order,expanded*sizeof(Node*));
+    if(numbers)allocator.deallocate(numbers,tableSize*sizeof(uint32_t));
+    if(table)allocator.deallocate(table,tableSize*sizeof(Node*));
+    return written;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::importModel(const uint8_t* data, size_t size, uint32_t cols){
+    //The current tree is kept until the new one is complete, a broken file or a lack of memory doesn't lose it
+    if(validateModel(data,size,cols)!=0)return INVALID_MODEL;
+    uint16_t modelOutputs;
+    uint32_t count;
+    uint32_t modelColumns;
+    memcpy(&modelOutputs,data+8,2);
+    memcpy(&count,data+12,4);
+    memcpy(&modelColumns,data+16,4);
+    size_t recordSize = 3*sizeof(uint32_t)+sizeof(TFeature)+modelOutputs*sizeof(TLabel);
+    const uint8_t* record = data+DTR_MODEL_HEADER_SIZE;
+
+    Node** nodes = (Node**)allocator.allocate(count*sizeof(Node*));
+    if(nodes==NULL)return NOT_ENOUGH_MEMORY;
+    //The recycled nodes keep decisions arrays of the old size, the nodes of the old tree are freed with it
+    uint16_t previousOutputs = outputs;
+    if(modelOutputs!=outputs)releaseFreeNodes();
+    outputs = modelOutputs;
+    uint32_t created = 0;
+    for(;created<count;created++){
+        Node* node = createNode();
+        if(node==NULL)break;
+        nodes[created] = node;
+        if(outputs>1 && node->decisions==NULL){
+            node->decisions = (TLabel *)allocator.allocate(outputs*sizeof(TLabel));
+            if(node->decisions==NULL){
+                created++;
+                break;
+            }
+        }
+        uint32_t fields[3];
+        const uint8_t* r = record+created*recordSize;
+        memcpy(fields,r,sizeof(fields));
+        memcpy(&node->nodeTh,r+sizeof(fields),sizeof(TFeature));
+        const uint8_t* decisionsRecord = r+sizeof(fields)+sizeof(TFeature);
+        memcpy(&node->decision,decisionsRecord,sizeof(TLabel));
+        if(node->decisions)memcpy(node->decisions,decisionsRecord,outputs*sizeof(TLabel));
+        node->parents = 0;
+        if(fields[0]==DTR_MODEL_LEAF){
+            node->decisionReady = true;
+        }else{
+            node->nodeThColumn = fields[0];
+            node->children[0] = nodes[fields[1]];
+            node->children[1] = nodes[fields[2]];
+            node->children[0]->parents++;
+            node->children[1]->parents++;
+            node->thReady = true;
+        }
+    }
+    int16_t rslt = 0;
+    if(created==count && (outputs==1 || nodes[count-1]->decisions!=NULL)){
+        //Only now the old tree goes, with the number of outputs its nodes were made for
+        outputs = previousOutputs;
+        dropTree();
+        if(modelOutputs!=outputs)releaseFreeNodes();
+        outputs = modelOutputs;
+        root = nodes[count-1];
+        root->parents++;
+        columns = modelColumns;
+        //Nodes nobody points to can only come from a broken file, they are dropped
+        for(uint32_t n=0;n<count-1;n++){
+            if(nodes[n]->parents==0){
+                nodes[n]->parents = 1;
+                releaseNode(nodes[n]);
+            }
+        }
+        trained = true;
+    }else{
+        for(uint32_t n=created;n>0;n--){
+            destroyNode(nodes[n-1]);
+        }
+        outputs = previousOutputs;
+        rslt = NOT_ENOUGH_MEMORY;
+    }
+    allocator.deallocate(nodes,count*sizeof(Node*));
+    return rslt;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::validateModel(const uint8_t* data, size_t size, uint32_t cols){
+    if(size<DTR_MODEL_HEADER_SIZE)return INVALID_MODEL;
+    uint32_t magic;
+    uint16_t modelOutputs;
+    uint32_t count;
+    uint32_t modelColumns;
+    memcpy(&magic,data,4);
+    memcpy(&modelOutputs,data+8,2);
+    memcpy(&count,data+12,4);
+    memcpy(&modelColumns,data+16,4);
+    if(magic!=DTR_MODEL_MAGIC || data[4]!=sizeof(TFeature) || data[5]!=(((TFeature)0.5)!=0 ? 1 : 0) || data[6]!=sizeof(TLabel) || modelOutputs==0 || count==0)return INVALID_MODEL;
+    if(cols!=0 && modelColumns>cols)return INVALID_MODEL;
+    size_t recordSize = 3*sizeof(uint32_t)+sizeof(TFeature)+modelOutputs*sizeof(TLabel);
+    if((size-DTR_MODEL_HEADER_SIZE)/recordSize<count)return INVALID_MODEL;
+
+    //Children come before their parents, so checking child<node is enough to reject cycles
+    const uint8_t* record = data+DTR_MODEL_HEADER_SIZE;
+    for(uint32_t n=0;n<count;n++){
+        uint32_t fields[3];
+        memcpy(fields,record+n*recordSize,sizeof(fields));
+        if(fields[0]!=DTR_MODEL_LEAF && (fields[0]>=modelColumns || fields[1]>=n || fields[2]>=n))return INVALID_MODEL;
+    }
+    return 0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::modelRecordSize(){
+    return 3*sizeof(uint32_t)+sizeof(TFeature)+outputs*sizeof(TLabel);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::prune(TFeature** X,TLabel** Y,uint32_t rows,float alpha){
+    if(!trained || rows==0)return 0;
+    typename Node::RowsSubIndexes rsi;
+    rsi.size = rows;
+    rsi.indexes = (uint32_t *)allocator.allocate(rows*sizeof(uint32_t));
+    if(rsi.indexes==NULL)return 0;
+    for(uint32_t i=0;i<rows;i++){
+        rsi.indexes[i]=i;
+    }
+    uint32_t leaves;
+    size_t freed = 0;
+    root->prune(X,Y,&rsi,alpha*rows,&leaves,&freed);
+    allocator.deallocate(rsi.indexes,rows*sizeof(uint32_t));
+    return freed;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::pruneCostComplexity(TFeature** X,TLabel** Y,uint32_t rows,float alpha){
+    return prune(X,Y,rows,alpha);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::pruneReducedError(TFeature** X,TLabel** Y,uint32_t rows){
+    return prune(X,Y,rows,0);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+float TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::score(TFeature** X,TLabel** Y,uint32_t rows){
+    float score = 0;
+    if(outputs<=1){
+        for(uint32_t i=0;i<rows;i++){
+            if(predict(X[i])==Y[i][0])score++;
+        }
+        return score/rows;
+    }
+    TLabel* predicted = (TLabel *)allocator.allocate(outputs*sizeof(TLabel));
+    if(predicted==NULL)return 0;
+    for(uint32_t i=0;i<rows;i++){
+        predict(X[i],predicted);
+        for(uint16_t o=0;o<outputs;o++){
+            if(predicted[o]==Y[i][o])score++;
+        }
+    }
+    allocator.deallocate(predicted,outputs*sizeof(TLabel));
+    return score/((float)rows*outputs);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+float TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::score(const TinySparseRows<TFeature>& X,TLabel** Y,uint32_t rows){
+    float score = 0;
+    if(outputs<=1){
+        for(uint32_t i=0;i<rows;i++){
+            if(predict(X,i)==Y[i][0])score++;
+        }
+        return score/rows;
+    }
+    TLabel* predicted = (TLabel *)allocator.allocate(outputs*sizeof(TLabel));
+    if(predicted==NULL)return 0;
+    for(uint32_t i=0;i<rows;i++){
+        predict(X,i,predicted);
+        for(uint16_t o=0;o<outputs;o++){
+            if(predicted[o]==Y[i][o])score++;
+        }
+    }
+    allocator.deallocate(predicted,outputs*sizeof(TLabel));
+    return score/((float)rows*outputs);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+float TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::expectedFeatureCost(TFeature** X,uint32_t rows){
+    if(!trained || rows==0)return 0;
+    uint32_t columns[DTR_LAZY_FEATURES];
+    float cost = 0;
+    for(uint32_t i=0;i<rows;i++){
+        uint16_t known = 0;
+        for(Node* node=root;!node->decisionReady && node->thReady && node->children[0]!=NULL;node=node->children[X[i][node->nodeThColumn]<=node->nodeTh ? 0 : 1]){
+            uint16_t k = 0;
+            while(k<known && columns[k]!=node->nodeThColumn)k++;
+            if(k<known)continue;
+            if(known<DTR_LAZY_FEATURES)columns[known++] = node->nodeThColumn;
+            cost += featureCosts ? featureCosts[node->nodeThColumn] : 1;
+        }
+    }
+    return cost/rows;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+float TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::score(TFeature** X,TLabel** Y,uint32_t rows,uint16_t depth){
+    if(!trained)return 0;
+    return countMatches(X,Y,rows,depth)/((float)rows*outputs);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::countMatches(TFeature** X,TLabel** Y,uint32_t rows,uint16_t depth){
+    if(!trained)return 0;
+    uint32_t matches = 0;
+    for(uint32_t i=0;i<rows;i++){
+        Node* node = findNode(X[i],depth);
+        if(node==NULL)continue;
+        for(uint16_t o=0;o<outputs;o++){
+            TLabel decision = node->decisions ? node->decisions[o] : node->decision;
+            if(decision==Y[i][o])matches++;
+        }
+    }
+    return matches;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+typename TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node* TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::profiledLeaf(TFeature* X){
+    Node* node = root;
+    for(;;){
+        uint32_t* counts = branchCounts+2*(node-nodeBlock);
+        if(node->decisionReady || !node->thReady || node->children[0]==NULL){
+            counts[0]++;
+            return node;
+        }
+        uint8_t branch = X[node->nodeThColumn]<=node->nodeTh ? 0 : 1;
+        counts[branch]++;
+        node = node->children[branch];
+    }
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+template < typename Provider >
+typename TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node* TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::lazyLeaf(Provider& feature){
+    uint32_t columns[DTR_LAZY_FEATURES];
+    TFeature values[DTR_LAZY_FEATURES];
+    uint16_t known = 0;
+    Node* node = root;
+    for(;;){
+        uint32_t* counts = branchCounts!=NULL ? branchCounts+2*(node-nodeBlock) : NULL;
+        if(node->decisionReady || !node->thReady || node->children[0]==NULL){
+            if(counts)counts[0]++;
+            return node;
+        }
+        uint16_t i = 0;
+        while(i<known && columns[i]!=node->nodeThColumn)i++;
+        TFeature x;
+        if(i<known){
+            x = values[i];
+        }else{
+            x = feature(node->nodeThColumn);
+            if(known<DTR_LAZY_FEATURES){
+                columns[known] = node->nodeThColumn;
+                values[known++] = x;
+            }
+        }
+        uint8_t branch = x<=node->nodeTh ? 0 : 1;
+        if(counts)counts[branch]++;
+        node = node->children[branch];
+    }
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+template < typename Provider >
+typename TinyEnableIf<!TinyFeatureRow<Provider,TFeature>::isRow,TLabel>::type TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::predict(Provider feature){
+    if(!trained)return 0;
+    Node* leaf = lazyLeaf(feature);
+    return leaf->decisionReady ? leaf->decision : 0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+template < typename Provider >
+typename TinyEnableIf<!TinyFeatureRow<Provider,TFeature>::isRow,void>::type TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::predict(Provider feature, TLabel* Y){
+    for(uint16_t o=0;o<outputs;o++)Y[o]=0;
+    if(!trained)return;
+    Node* node = lazyLeaf(feature);
+    if(!node->decisionReady)return;
+    if(node->decisions){
+        for(uint16_t o=0;o<outputs;o++)Y[o]=node->decisions[o];
+    }else{
+        Y[0]=node->decision;
+    }
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+TLabel TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::predict(const TinySparseRows<TFeature>& X, uint32_t row){
+    SparseRow feature = {&X,row};
+    return predict(feature);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::predict(const TinySparseRows<TFeature>& X, uint32_t row, TLabel* Y){
+    SparseRow feature = {&X,row};
+    predict(feature,Y);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::beginProfile(void){
+    if(!trained)return 0;
+    if(nodeBlock==NULL){
+        int16_t rslt = relayout();
+        if(rslt!=0)return rslt;
+    }
+    if(branchCounts==NULL){
+        branchCounts = (uint32_t *)allocator.allocate(2*nodeBlockSize*sizeof(uint32_t));
+        if(branchCounts==NULL)return NOT_ENOUGH_MEMORY;
+    }
+    memset(branchCounts,0,2*nodeBlockSize*sizeof(uint32_t));
+    return 0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::endProfile(void){
+    if(branchCounts)allocator.deallocate(branchCounts,2*nodeBlockSize*sizeof(uint32_t));
+    branchCounts=NULL;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::releaseBlock(void){
+    endProfile();
+    if(nodeBlock)allocator.deallocate(nodeBlock,nodeBlockSize*sizeof(Node));
+    nodeBlock=NULL;
+    nodeBlockSize=0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::relayout(void){
+    if(!trained)return 0;
+    uint32_t expanded = countNodes(root);
+    uint32_t tableSize = 2;
+    while(tableSize<2*expanded)tableSize<<=1;
+    uint32_t mask = tableSize-1;
+    Node** table = (Node**)allocator.allocate(tableSize*sizeof(Node*));
+    uint32_t* numbers = (uint32_t *)allocator.allocate(tableSize*sizeof(uint32_t));
+    Node** order = (Node**)allocator.allocate(expanded*sizeof(Node*));
+    Node** stack = (Node**)allocator.allocate((expanded+1)*sizeof(Node*));
+    if(table==NULL || numbers==NULL || order==NULL || stack==NULL){
+        if(stack)allocator.deallocate(stack,(expanded+1)*sizeof(Node*));
+        if(order)allocator.deallocate(order,expanded*sizeof(Node*));
+        if(numbers)allocator.deallocate(numbers,tableSize*sizeof(uint32_t));
+        if(table)allocator.deallocate(table,tableSize*sizeof(Node*));
+        return NOT_ENOUGH_MEMORY;
+    }
+    for(uint32_t i=0;i<tableSize;i++){
+        table[i]=NULL;
+    }
+
+    //Preorder with the hot child pushed last, so it is popped and numbered right after its parent
+    uint32_t count = 0;
+    uint32_t top = 0;
+    stack[top++] = root;
+    while(top>0){
+        Node* node = stack[--top];
+        uint32_t slot = nodeSlot(node,table,mask);
+        if(table[slot]!=NULL)continue;
+        table[slot] = node;
+        numbers[slot] = count;
+        order[count++] = node;
+        if(node->children[0]==NULL)continue;
+        uint8_t hot = 0;
+        if(branchCounts!=NULL){
+            uint32_t* counts = branchCounts+2*(node-nodeBlock);
+            if(counts[1]>counts[0])hot = 1;
+        }
+        stack[top++] = node->children[1-hot];
+        stack[top++] = node->children[hot];
+    }
+
+    Node* block = (Node*)allocator.allocate(count*sizeof(Node));
+    uint32_t* counts = NULL;
+    if(block!=NULL && branchCounts!=NULL){
+        counts = (uint32_t *)allocator.allocate(2*count*sizeof(uint32_t));
+        if(counts==NULL){
+            allocator.deallocate(block,count*sizeof(Node));
+            block = NULL;
+        }
+    }
+    if(block!=NULL){
+        for(uint32_t i=0;i<count;i++){
+            Node* node = order[i];
+            memcpy((void*)(block+i),(const void*)node,sizeof(Node));
+            if(node->children[0]!=NULL){
+                block[i].children[0] = block+numbers[nodeSlot(node->children[0],table,mask)];
+                block[i].children[1] = block+numbers[nodeSlot(node->children[1],table,mask)];
+            }
+            if(counts!=NULL){
+                uint32_t* oldCounts = branchCounts+2*(node-nodeBlock);
+                counts[2*i] = oldCounts[0];
+                counts[2*i+1] = oldCounts[1];
+            }
+        }
+        //The decisions arrays moved with the copies, only the node memory is freed
+        for(uint32_t i=0;i<count;i++){
+            if(!inBlock(order[i]))allocator.deallocate(order[i],sizeof(Node));
+        }
+        releaseBlock();
+        nodeBlock = block;
+        nodeBlockSize = count;
+        branchCounts = counts;
+        root = block;
+    }
+    allocator.deallocate(stack,(expanded+1)*sizeof(Node*));
+    allocator.deallocate(order,expanded*sizeof(Node*));
+    allocator.deallocate(numbers,tableSize*sizeof(uint32_t));
+    allocator.deallocate(table,tableSize*sizeof(Node*));
+    return block!=NULL ? 0 : NOT_ENOUGH_MEMORY;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::pruneColdNodes(uint32_t minVisits){
+    if(!trained || branchCounts==NULL)return 0;
+    return pruneCold(root,minVisits);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::pruneCold(Node* node, uint32_t minVisits){
+    if(node->children[0]==NULL)return 0;
+    uint32_t* counts = branchCounts+2*(node-nodeBlock);
+    if(counts[0]+counts[1]<minVisits){
+        size_t freed = node->cleanup();
+        node->thReady = false;
+        node->decisionReady = true;
+        return freed;
+    }
+    return pruneCold(node->children[0],minVisits)+pruneCold(node->children[1],minVisits);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::init(TinyDecisionTreeClassifier* tree){
+    this->tree = tree;
+    children[0] = NULL;
+    children[1] = NULL;
+    decisions = NULL;
+    decisionReady = false;
+    thReady = false;
+    nodeTh = 0;
+    nodeThColumn = 0;
+    parents = 1;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+void TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::adopt(TinyDecisionTreeClassifier* tree){
+    //Shared nodes of a DAG are visited once
+    if(this->tree==tree)return;
+    this->tree = tree;
+    if(children[0]!=NULL){
+        children[0]->adopt(tree);
+        children[1]->adopt(tree);
+    }
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+bool TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::expand(TFeature** X, RowsSubIndexes* rsi, uint32_t cols, uint32_t currentDepth, RowsSubIndexes* rsiBelowTh, RowsSubIndexes* rsiAboveTh){
+    #ifdef DTR_DEBUG_
+    DTR_DEBUG_PRINTLN();
+    DTR_DEBUG_PRINTLN("Expanding node:");
+    for(uint32_t i=0;X!=NULL && i<rsi->size;i++){
+        for(uint32_t j=0;j<cols;j++){
+            DTR_DEBUG_PRINT(X[rsi->indexes[i]][j]);
+            DTR_DEBUG_PRINT(' ');
+        }
+        DTR_DEBUG_PRINT("-> ");
+        DTR_DEBUG_PRINTLN(tree->classLabels[tree->rowClasses[rsi->indexes[i]*tree->outputs]]);
+    }
+    #endif
+    //Every node keeps its majority decision(s), leaves use them for predict, inner nodes for pruning
+    //Without its decisions the node would silently predict 0, so the whole fit fails instead
+    if(tree->outputs>1 && decisions==NULL){
+        decisions = (TLabel *)tree->allocator.allocate(tree->outputs*sizeof(TLabel));
+        if(decisions==NULL){
+            tree->fitOutOfMemory = true;
+            return false;
+        }
+    }
+    uint32_t* counts = (uint32_t *)tree->allocator.allocate(tree->totalClasses*sizeof(uint32_t));
+    if(counts==NULL){
+        #ifdef DTR_DEBUG_
+        DTR_DEBUG_PRINTLN("Not enough memory to count the classes");
+        #endif
+        tree->fitOutOfMemory = true;
+        return false;
+    }
+    uint32_t total = countClasses(rsi,counts);
+    bool pure = setDecisions(counts,total);
+    tree->allocator.deallocate(counts,tree->totalClasses*sizeof(uint32_t));
+
+    if(pure){
+        decisionReady = true;
+        #ifdef DTR_DEBUG_
+        DTR_DEBUG_PRINT("Only unique class, finish splitting, decision is ");
+        DTR_DEBUG_PRINTLN(decision);
+        #endif
+        return false;
+    }
+    else if (total<tree->minSamplesSplit){
+        decisionReady = true;
+        #ifdef DTR_DEBUG_
+        DTR_DEBUG_PRINTLN("Length of X and Y is less than min sample split, decision is ");
+        DTR_DEBUG_PRINTLN(decision);
+        #endif
+        return false;
+    }
+    else if (currentDepth == tree->maxDepth){
+        decisionReady = true;
+        #ifdef DTR_DEBUG_
+        DTR_DEBUG_PRINT("Max depth reached, decision is ");
+        DTR_DEBUG_PRINTLN(decision);
+        #endif
+        return false;
+    }
+ 
+    TFeature th;
+    uint32_t thColumn;
+    int16_t rslt = getBestSplit(X,rsi,cols,rsiAboveTh,rsiBelowTh,&th,&thColumn);
+    if(rslt == 0){
+        children[0] = tree->createNode();
+        children[1] = tree->createNode();
+        if(children[0]==NULL || children[1]==NULL){
+            if(children[0]!=NULL)tree->destroyNode(children[0]);
+            if(children[1]!=NULL)tree->destroyNode(children[1]);
+            children[0] = NULL;
+            children[1] = NULL;
+            decisionReady = true;
+            return false;
+        }
+        nodeTh=th;
+        nodeThColumn=thColumn;
+        thReady = true;
+        return true;
+    }
+    decisionReady = true;
+    return false;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::countClasses(RowsSubIndexes* rsi, uint32_t* counts){
+    uint16_t outputs = tree->outputs;
+    uint32_t total = 0;
+    for(uint32_t c=0;c<tree->totalClasses;c++)counts[c]=0;
+    for(uint32_t i=0;i<rsi->size;i++){
+        uint16_t* rowClasses = tree->rowClasses+rsi->indexes[i]*outputs;
+        uint32_t w = tree->rowWeight(rsi->indexes[i]);
+        for(uint16_t o=0;o<outputs;o++){
+            counts[tree->classOffsets[o]+rowClasses[o]]+=w;
+        }
+        total+=w;
+    }
+    return total;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+bool TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::setDecisions(uint32_t* counts, uint32_t total){
+    bool pure = true;
+    for(uint16_t o=0;o<tree->outputs;o++){
+        uint32_t maxOcc=0;
+        uint32_t maxOccIdx=tree->classOffsets[o];
+        for(uint32_t c=tree->classOffsets[o];c<tree->classOffsets[o+1];c++){
+            if(counts[c]>maxOcc){
+                maxOcc=counts[c];
+                maxOccIdx=c;
+            }
+        }
+        if(maxOcc!=total)pure=false;
+        if(o==0)decision=tree->classLabels[maxOccIdx];
+        if(decisions)decisions[o]=tree->classLabels[maxOccIdx];
+    }
+    return pure;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+float TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::impurity(uint32_t* counts, uint32_t total){
+    //Combined impurity of all the outputs
+    float entropy=0;
+    for(uint16_t o=0;o<tree->outputs;o++){
+        entropy += entropyFromCounts(counts+tree->classOffsets[o],tree->classOffsets[o+1]-tree->classOffsets[o],total);
+    }
+    return entropy;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::getBestSplit(TFeature** X, RowsSubIndexes* rsi, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column){
+    if(tree->fitSparse.rowStart!=NULL){
+        return getSparseSplit(X,rsi,cols,rsiAboveTh,rsiBelowTh,threshold,column);
+    }
+    if(tree->presortedStride!=0){
+        return getPresortedSplit(X,rsi,cols,rsiAboveTh,rsiBelowTh,threshold,column);
+    }
+    if(tree->subsampleThreshold!=0 && rsi->size>tree->subsampleThreshold && tree->subsampleSize>=2 && tree->subsampleSize<rsi->size){
+        int16_t rslt = getSubsampledSplit(X,rsi,cols,rsiAboveTh,rsiBelowTh,threshold,column);
+        if(rslt==0)return 0;
+        //The sample wasn't enough to split the node, falling back to the exact search
+    }
+    if(tree->splitMode==DTR_SPLIT_RANDOM){
+        return getRandomSplit(X,rsi,cols,rsiAboveTh,rsiBelowTh,threshold,column);
+    }
+    return getExactSplit(X,rsi,cols,rsiAboveTh,rsiBelowTh,threshold,column);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::getPresortedSplit(TFeature** X, RowsSubIndexes* rsi, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column){
+    uint32_t classes = tree->totalClasses;
+    uint16_t outputs = tree->outputs;
+    uint32_t stride = tree->presortedStride;
+    float bestInfoGain=-FLT_MAX;
+
+    uint32_t* counts = (uint32_t *)tree->allocator.allocate(3*classes*sizeof(uint32_t));
+    if(counts==NULL)return NOT_ENOUGH_MEMORY;
+    uint32_t* countsBelow = counts+classes;
+    uint32_t* countsAbove = counts+2*classes;
+    uint32_t total = countClasses(rsi,counts);
+    float entropyBeforeTheSplit=impurity(counts,total);
+    float perfectGain=perfectSplitGain(entropyBeforeTheSplit);
+
+    uint32_t featuresLeft=tree->featuresPerSplit(cols);
+    bool allFeatures=(featuresLeft==cols);
+    uint32_t first=allFeatures ? parentColumn(X,rsi,cols) : cols;
+    for(uint32_t k=0;;k++){
+        if(k==cols){
+            //None of the chosen features can split the data, so all of them are checked
+            if(allFeatures || bestInfoGain!=-FLT_MAX)break;
+            allFeatures=true;
+            k=0;
+        }
+        if(!allFeatures){
+            if(tree->random(cols-k)>=featuresLeft)continue;
+            featuresLeft--;
+        }
+        uint32_t i = columnAt(k,first,cols);
+        float cost = splitCost(X,rsi,i);
+        if(bestInfoGain!=-FLT_MAX && !beats(perfectGain-cost,i,bestInfoGain,*column))continue;
+        //The same scan as getExactSplit, the rows of the node are already sorted by this column
+        uint32_t* sorted = rsi->indexes+i*stride;
+        if(!(X[sorted[0]][i]!=X[sorted[rsi->size-1]][i]))continue;
+        for(uint32_t c=0;c<classes;c++){
+            countsBelow[c]=0;
+            countsAbove[c]=counts[c];
+        }
+        uint32_t weightBelow=0;
+        //A NaN row is never <= the threshold, it stays above and is not a neighbour of any threshold
+        bool seen=false;
+        TFeature previous=0;
+        for(uint32_t j=1;j<rsi->size;j++){
+            TFeature last = X[sorted[j-1]][i];
+            if(last==last){
+                uint16_t* rowClasses = tree->rowClasses+sorted[j-1]*outputs;
+                uint32_t w = tree->rowWeight(sorted[j-1]);
+                for(uint16_t o=0;o<outputs;o++){
+                    uint32_t c = tree->classOffsets[o]+rowClasses[o];
+                    countsBelow[c]+=w;
+                    countsAbove[c]-=w;
+                }
+                weightBelow+=w;
+                previous=last;
+                seen=true;
+            }
+            TFeature current = X[sorted[j]][i];
+            if(seen && previous<current){
+                float infoGain = entropyBeforeTheSplit - (impurity(countsBelow,weightBelow)*(((float)weightBelow)/((float)total))+impurity(countsAbove,total-weightBelow)*(((float)(total-weightBelow))/((float)total)))-cost;
+                if(beats(infoGain,i,bestInfoGain,*column)){
+                    bestInfoGain=infoGain;
+                    *threshold=midpoint(previous,current);
+                    *column=i;
+                }
+            }
+        }
     }
-    root = new Node(maxDepth,minSamplesSplit);
-    typename Node::RowsSubIndexes rootRsi;
-    rootRsi.size = rows;
-    rootRsi.indexes = (uint32_t *)malloc(rows*sizeof(uint32_t));
-    for(uint32_t i=0;i<rows;i++){
-        rootRsi.indexes[i]=i;
+    tree->allocator.deallocate(counts,3*classes*sizeof(uint32_t));
+
+    if(bestInfoGain==-FLT_MAX){
+        #ifdef DTR_DEBUG_
+        DTR_DEBUG_PRINT("Can't split all the samples have the same value");
+        #endif
+        return CANT_SPLIT_ALL_THE_SAMPLES_HAVE_THE_SAME_VALUE;
     }
-    root->recurcisiveFit(X,Y,&rootRsi,cols,1);
-    trained=true;
-};
 
-template < typename T >
-void TinyDecisionTreeClassifier<T>::plot(void){
-    plot(root,0);
+    //Stable partition keeps every list sorted, the rows above the threshold wait in the scratch buffer.
+    //The sides are counted by the comparison predict() makes, the NaN rows end up above
+    uint32_t bestSplit=0;
+    for(uint32_t j=0;j<rsi->size;j++){
+        if(X[rsi->indexes[j]][*column]<=*threshold)bestSplit++;
+    }
+    uint32_t* above = (uint32_t *)tree->allocator.allocate((rsi->size-bestSplit)*sizeof(uint32_t));
+    if(above==NULL)return NOT_ENOUGH_MEMORY;
+    for(uint32_t c=0;c<cols;c++){
+        uint32_t* list = rsi->indexes+c*stride;
+        uint32_t below = 0;
+        uint32_t aboveSize = 0;
+        for(uint32_t j=0;j<rsi->size;j++){
+            if(X[list[j]][*column]<=*threshold)list[below++]=list[j];
+            else above[aboveSize++]=list[j];
+        }
+        for(uint32_t j=0;j<aboveSize;j++){
+            list[below+j]=above[j];
+        }
+    }
+    tree->allocator.deallocate(above,(rsi->size-bestSplit)*sizeof(uint32_t));
+
+    rsiBelowTh->indexes=rsi->indexes;
+    rsiBelowTh->size=bestSplit;
+    rsiAboveTh->indexes=rsi->indexes+bestSplit;
+    rsiAboveTh->size=rsi->size-bestSplit;
+    #ifdef DTR_DEBUG_
+    DTR_DEBUG_PRINT("Presorted split in column ");
+    DTR_DEBUG_PRINT(*column);
+    DTR_DEBUG_PRINT(" with threhold ");
+    DTR_DEBUG_PRINT(*threshold);
+    DTR_DEBUG_PRINT(" and infogain ");
+    DTR_DEBUG_PRINTLN(bestInfoGain);
+    #endif
+    return 0;
 }
 
-template < typename T >
-void TinyDecisionTreeClassifier<T>::plot(Node* node,uint32_t depth){
-    if(node->thReady){
-        for(uint32_t i=0;i<depth;i++){
-            DTR_DEBUG_PRINT("               ");
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::getSubsampledSplit(TFeature** X, RowsSubIndexes* rsi, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column){
+    RowsSubIndexes sample;
+    sample.size = tree->subsampleSize;
+    sample.indexes = (uint32_t *)tree->allocator.allocate(sample.size*sizeof(uint32_t));
+    if(sample.indexes==NULL)return NOT_ENOUGH_MEMORY;
+
+    //Selection sampling, every row has the same chance and the sample keeps the original order
+    uint32_t needed = sample.size;
+    for(uint32_t i=0;i<rsi->size && needed>0;i++){
+        if(tree->random(rsi->size-i)<needed){
+            sample.indexes[sample.size-needed]=rsi->indexes[i];
+            needed--;
         }
-        DTR_DEBUG_PRINT("if(X[");
-        DTR_DEBUG_PRINT(node->nodeThColumn);
-        DTR_DEBUG_PRINT("]<=");
-        DTR_DEBUG_PRINT(node->nodeTh);
-        DTR_DEBUG_PRINTLN(")");
     }
-    if(node->decisionReady){
-        for(uint32_t i=0;i<depth;i++){
-            DTR_DEBUG_PRINT("               ");
+
+    RowsSubIndexes sampleAboveTh;
+    RowsSubIndexes sampleBelowTh;
+    int16_t rslt = getExactSplit(X,&sample,cols,&sampleAboveTh,&sampleBelowTh,threshold,column);
+    tree->allocator.deallocate(sample.indexes,sample.size*sizeof(uint32_t));
+    if(rslt!=0)return rslt;
+
+    uint32_t below = partition(X,rsi,*threshold,*column);
+    if(below==0 || below==rsi->size)return CANT_SPLIT_ALL_THE_SAMPLES_HAVE_THE_SAME_VALUE;
+    rsiBelowTh->indexes=rsi->indexes;
+    rsiBelowTh->size=below;
+    rsiAboveTh->indexes=rsi->indexes+below;
+    rsiAboveTh->size=rsi->size-below;
+    #ifdef DTR_DEBUG_
+    DTR_DEBUG_PRINT("Subsampled split in column ");
+    DTR_DEBUG_PRINT(*column);
+    DTR_DEBUG_PRINT(" with threhold ");
+    DTR_DEBUG_PRINTLN(*threshold);
+    #endif
+    return 0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::getSparseSplit(TFeature** X, RowsSubIndexes* rsi, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column){
+    const TinySparseRows<TFeature>& sparse = tree->fitSparse;
+    uint32_t classes = tree->totalClasses;
+    uint16_t outputs = tree->outputs;
+    float bestInfoGain=-FLT_MAX;
+
+    uint32_t nonzeros = 0;
+    for(uint32_t j=0;j<rsi->size;j++){
+        nonzeros += sparse.rowStart[rsi->indexes[j]+1]-sparse.rowStart[rsi->indexes[j]];
+    }
+    uint32_t* starts = (uint32_t *)tree->allocator.allocate((cols+1)*sizeof(uint32_t));
+    TFeature* values = (TFeature *)tree->allocator.allocate((nonzeros ? nonzeros : 1)*sizeof(TFeature));
+    uint32_t* owners = (uint32_t *)tree->allocator.allocate((nonzeros ? nonzeros : 1)*sizeof(uint32_t));
+    uint32_t* counts = (uint32_t *)tree->allocator.allocate(4*classes*sizeof(uint32_t));
+    if(starts==NULL || values==NULL || owners==NULL || counts==NULL){
+        if(counts)tree->allocator.deallocate(counts,4*classes*sizeof(uint32_t));
+        if(owners)tree->allocator.deallocate(owners,(nonzeros ? nonzeros : 1)*sizeof(uint32_t));
+        if(values)tree->allocator.deallocate(values,(nonzeros ? nonzeros : 1)*sizeof(TFeature));
+        if(starts)tree->allocator.deallocate(starts,(cols+1)*sizeof(uint32_t));
+        return NOT_ENOUGH_MEMORY;
+    }
+    uint32_t* countsBelow = counts+classes;
+    uint32_t* countsAbove = counts+2*classes;
+    uint32_t* countsZero = counts+3*classes;
+    uint32_t total = countClasses(rsi,counts);
+    float entropyBeforeTheSplit=impurity(counts,total);
+    float perfectGain=perfectSplitGain(entropyBeforeTheSplit);
+
+    //The nonzero values of the node grouped by column (counting sort), values[starts[c]..starts[c+1]) belong to column c
+    for(uint32_t c=0;c<=cols;c++)starts[c]=0;
+    for(uint32_t j=0;j<rsi->size;j++){
+        uint32_t row = rsi->indexes[j];
+        for(uint32_t e=sparse.rowStart[row];e<sparse.rowStart[row+1];e++){
+            if(sparse.columns[e]<cols)starts[sparse.columns[e]+1]++;
         }
-        DTR_DEBUG_PRINT("Y=(");
-        DTR_DEBUG_PRINT(node->decision);
-        DTR_DEBUG_PRINTLN(")");
     }
-    
-    if(node->children[0]!=NULL){
-        for(uint16_t i=0;i<2;i++){
-            plot(node->children[i],depth+1);
+    for(uint32_t c=0;c<cols;c++)starts[c+1]+=starts[c];
+    for(uint32_t j=0;j<rsi->size;j++){
+        uint32_t row = rsi->indexes[j];
+        for(uint32_t e=sparse.rowStart[row];e<sparse.rowStart[row+1];e++){
+            if(sparse.columns[e]>=cols)continue;
+            uint32_t k = starts[sparse.columns[e]]++;
+            values[k] = sparse.values[e];
+            owners[k] = row;
         }
     }
-}
+    //Filling moved every start to the end of its column
+    for(uint32_t c=cols;c>0;c--)starts[c]=starts[c-1];
+    starts[0]=0;
 
-template < typename T >
-T TinyDecisionTreeClassifier<T>::predict(T* X){
-    if(!trained)return 0;
-    return root->decide(X);
-}
+    //The same order of the columns, bounds and ties as getExactSplit, so the trees are the same
+    uint32_t featuresLeft=tree->featuresPerSplit(cols);
+    bool allFeatures=(featuresLeft==cols);
+    uint32_t first=allFeatures ? parentColumn(X,rsi,cols) : cols;
+    for(uint32_t k=0;;k++){
+        if(k==cols){
+            //None of the chosen features can split the data, so all of them are checked
+            if(allFeatures || bestInfoGain!=-FLT_MAX)break;
+            allFeatures=true;
+            k=0;
+        }
+        if(!allFeatures){
+            if(tree->random(cols-k)>=featuresLeft)continue;
+            featuresLeft--;
+        }
+        uint32_t i = columnAt(k,first,cols);
+        float cost = splitCost(X,rsi,i);
+        if(bestInfoGain!=-FLT_MAX && !beats(perfectGain-cost,i,bestInfoGain,*column))continue;
+        uint32_t start = starts[i];
+        uint32_t n = starts[i+1]-start;
+        //Only zeros, nothing to split
+        if(n==0)continue;
+        TinySort<TFeature>::sort(values+start,owners+start,n,&tree->allocator);
 
-template < typename T >
-float TinyDecisionTreeClassifier<T>::score(T** X,T** Y,uint32_t rows){
-    float score = 0;
-    for(uint32_t i=0;i<rows;i++){
-        if(predict(X[i])==Y[i][0])score++;
+        //The rows with a 0 are the node minus the nonzero rows
+        for(uint32_t c=0;c<classes;c++)countsZero[c]=counts[c];
+        uint32_t weightZero=total;
+        for(uint32_t e=start;e<start+n;e++){
+            uint16_t* rowClasses = tree->rowClasses+owners[e]*outputs;
+            uint32_t w = tree->rowWeight(owners[e]);
+            for(uint16_t o=0;o<outputs;o++){
+                countsZero[tree->classOffsets[o]+rowClasses[o]]-=w;
+            }
+            weightZero-=w;
+        }
+
+        //The scan of getExactSplit, the zeros move below as one group right before the first value that isn't negative
+        for(uint32_t c=0;c<classes;c++){
+            countsBelow[c]=0;
+            countsAbove[c]=counts[c];
+        }
+        uint32_t weightBelow=0;
+        bool zerosLeft=(rsi->size>n);
+        bool firstValue=true;
+        TFeature previous=0;
+        uint32_t e=start;
+        while(e<start+n || zerosLeft){
+            bool zeros = zerosLeft && (e==start+n || !(values[e]<0));
+            TFeature current = zeros ? (TFeature)0 : values[e];
+            if(!firstValue && current!=previous){
+                float infoGain = entropyBeforeTheSplit - (impurity(countsBelow,weightBelow)*(((float)weightBelow)/((float)total))+impurity(countsAbove,total-weightBelow)*(((float)(total-weightBelow))/((float)total)))-cost;
+                if(beats(infoGain,i,bestInfoGain,*column)){
+                    bestInfoGain=infoGain;
+                    *threshold=midpoint(previous,current);
+                    *column=i;
+                }
+            }
+            if(zeros){
+                for(uint32_t c=0;c<classes;c++){
+                    countsBelow[c]+=countsZero[c];
+                    countsAbove[c]-=countsZero[c];
+                }
+                weightBelow+=weightZero;
+                zerosLeft=false;
+            }else{
+                uint16_t* rowClasses = tree->rowClasses+owners[e]*outputs;
+                uint32_t w = tree->rowWeight(owners[e]);
+                for(uint16_t o=0;o<outputs;o++){
+                    uint32_t c = tree->classOffsets[o]+rowClasses[o];
+                    countsBelow[c]+=w;
+                    countsAbove[c]-=w;
+                }
+                weightBelow+=w;
+                e++;
+            }
+            previous=current;
+            firstValue=false;
+        }
     }
-    return score/rows;
-}
+    tree->allocator.deallocate(counts,4*classes*sizeof(uint32_t));
+    tree->allocator.deallocate(owners,(nonzeros ? nonzeros : 1)*sizeof(uint32_t));
+    tree->allocator.deallocate(values,(nonzeros ? nonzeros : 1)*sizeof(TFeature));
+    tree->allocator.deallocate(starts,(cols+1)*sizeof(uint32_t));
 
-template < typename T >
-TinyDecisionTreeClassifier<T>::Node::Node(uint16_t maxDepth, uint16_t minSamplesSplit){
-    this->maxDepth = maxDepth;
-    this->minSamplesSplit = minSamplesSplit;
+    if(bestInfoGain==-FLT_MAX){
+        #ifdef DTR_DEBUG_
+        DTR_DEBUG_PRINT("Can't split all the samples have the same value");
+        #endif
+        return CANT_SPLIT_ALL_THE_SAMPLES_HAVE_THE_SAME_VALUE;
+    }
+    //partition() with the sparse values
+    uint32_t below = 0;
+    uint32_t end = rsi->size;
+    while(below<end){
+        if(sparse.value(rsi->indexes[below],*column)<=*threshold){
+            below++;
+        }else{
+            end--;
+            uint32_t t = rsi->indexes[below];
+            rsi->indexes[below] = rsi->indexes[end];
+            rsi->indexes[end] = t;
+        }
+    }
+    rsiBelowTh->indexes=rsi->indexes;
+    rsiBelowTh->size=below;
+    rsiAboveTh->indexes=rsi->indexes+below;
+    rsiAboveTh->size=rsi->size-below;
+    #ifdef DTR_DEBUG_
+    DTR_DEBUG_PRINT("Sparse split in column ");
+    DTR_DEBUG_PRINT(*column);
+    DTR_DEBUG_PRINT(" with threhold ");
+    DTR_DEBUG_PRINT(*threshold);
+    DTR_DEBUG_PRINT(" and infogain ");
+    DTR_DEBUG_PRINTLN(bestInfoGain);
+    #endif
+    return 0;
 }
 
-template < typename T >
-int16_t TinyDecisionTreeClassifier<T>::Node::recurcisiveFit(T** X,T** Y, RowsSubIndexes* rsi, uint32_t cols, uint32_t currentDepth){
-    UniqueValues uv;
-    #ifdef DTR_DEBUG_
-    DTR_DEBUG_PRINTLN();
-    DTR_DEBUG_PRINTLN("Recursive fit:");
-    for(uint32_t i=0;i<rsi->size;i++){
-        for(uint32_t j=0;j<cols;j++){
-            DTR_DEBUG_PRINT(X[rsi->indexes[i]][j]);
-            DTR_DEBUG_PRINT(' ');
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::getRandomSplit(TFeature** X, RowsSubIndexes* rsi, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column){
+    uint32_t classes = tree->totalClasses;
+    uint16_t outputs = tree->outputs;
+    uint32_t* counts = (uint32_t *)tree->allocator.allocate(3*classes*sizeof(uint32_t));
+    if(counts==NULL)return NOT_ENOUGH_MEMORY;
+    uint32_t* countsBelow = counts+classes;
+    uint32_t* countsAbove = counts+2*classes;
+    uint32_t total = countClasses(rsi,counts);
+
+    float entropyBeforeTheSplit=impurity(counts,total);
+    float bestInfoGain=-FLT_MAX;
+    uint32_t featuresLeft=tree->featuresPerSplit(cols);
+    bool allFeatures=(featuresLeft==cols);
+    for(uint32_t i=0;;i++){
+        if(i==cols){
+            //None of the chosen features can split the data, so all of them are checked
+            if(allFeatures || bestInfoGain!=-FLT_MAX)break;
+            allFeatures=true;
+            i=0;
+        }
+        if(!allFeatures){
+            if(tree->random(cols-i)>=featuresLeft)continue;
+            featuresLeft--;
+        }
+        TFeature min = X[rsi->indexes[0]][i];
+        TFeature max = min;
+        for(uint32_t j=1;j<rsi->size;j++){
+            TFeature v = X[rsi->indexes[j]][i];
+            if(v<min)min=v;
+            if(v>max)max=v;
+        }
+        if(!(min<max))continue;
+        float cost = splitCost(X,rsi,i);
+
+        //0 would skip every feature and turn every node into a leaf
+        uint8_t splits = tree->randomSplitsPerFeature ? tree->randomSplitsPerFeature : 1;
+        for(uint8_t k=0;k<splits;k++){
+            //Uniform threshold in [min,max), rounded down for the integer types
+            float f = (float)min + ((float)max-(float)min)*((float)tree->random(1UL<<24)/(float)(1UL<<24));
+            TFeature th = (TFeature)f;
+            if((float)th>f)th=th-1;
+            if(th<min || !(th<max))th=min;
+
+            //Single counting pass, the class of every row was looked up once per fit
+            for(uint32_t c=0;c<classes;c++)countsBelow[c]=0;
+            uint32_t below=0;
+            for(uint32_t j=0;j<rsi->size;j++){
+                if(X[rsi->indexes[j]][i]<=th){
+                    uint16_t* rowClasses = tree->rowClasses+rsi->indexes[j]*outputs;
+                    uint32_t w = tree->rowWeight(rsi->indexes[j]);
+                    for(uint16_t o=0;o<outputs;o++){
+                        countsBelow[tree->classOffsets[o]+rowClasses[o]]+=w;
+                    }
+                    below+=w;
+                }
+            }
+            for(uint32_t c=0;c<classes;c++)countsAbove[c]=counts[c]-countsBelow[c];
+            float infoGain = entropyBeforeTheSplit - (impurity(countsBelow,below)*(((float)below)/((float)total))+impurity(countsAbove,total-below)*(((float)(total-below))/((float)total)))-cost;
+            if(infoGain>bestInfoGain){
+                bestInfoGain=infoGain;
+                *threshold=th;
+                *column=i;
+            }
         }
-        DTR_DEBUG_PRINT("-> ");
-        DTR_DEBUG_PRINTLN(Y[rsi->indexes[i]][0]);
     }
-    #endif
-    countUniqueValuesAndOccurances(Y,rsi,0,&uv);
-    if(uv.uniqueValuesSize==1){
-        decision = uv.uniqueValues[0];
-        decisionReady = true;
+    tree->allocator.deallocate(counts,3*classes*sizeof(uint32_t));
+
+    if(bestInfoGain==-FLT_MAX){
         #ifdef DTR_DEBUG_
-        DTR_DEBUG_PRINT("Only unique class, finish splitting, decision is ");
-        DTR_DEBUG_PRINTLN(decision);
+        DTR_DEBUG_PRINT("Can't split all the samples have the same value");
         #endif
-        return 0;
+        return CANT_SPLIT_ALL_THE_SAMPLES_HAVE_THE_SAME_VALUE;
     }
-    else if (rsi->size<minSamplesSplit){
-        decision = getMajorClass(&uv);
-        decisionReady = true;
-        #ifdef DTR_DEBUG_
-        DTR_DEBUG_PRINTLN("Length of X and Y is less than min sample split, decision is ");
-        DTR_DEBUG_PRINTLN(decision);
-        #endif
-        return 0;
+    uint32_t below = partition(X,rsi,*threshold,*column);
+    rsiBelowTh->indexes=rsi->indexes;
+    rsiBelowTh->size=below;
+    rsiAboveTh->indexes=rsi->indexes+below;
+    rsiAboveTh->size=rsi->size-below;
+    #ifdef DTR_DEBUG_
+    DTR_DEBUG_PRINT("Random split in column ");
+    DTR_DEBUG_PRINT(*column);
+    DTR_DEBUG_PRINT(" with threhold ");
+    DTR_DEBUG_PRINT(*threshold);
+    DTR_DEBUG_PRINT(" and infogain ");
+    DTR_DEBUG_PRINTLN(bestInfoGain);
+    #endif
+    return 0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+float TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::splitCost(TFeature** X, RowsSubIndexes* rsi, uint32_t column){
+    if(tree->featureCosts==NULL || tree->costPenalty==0)return 0;
+    uint32_t row = pathRow(X,rsi);
+    if(row!=0xFFFFFFFF){
+        for(Node* node=tree->root;node!=this;node=node->children[cell(X,row,node->nodeThColumn)<=node->nodeTh ? 0 : 1]){
+            if(node->nodeThColumn==column)return 0;
+        }
     }
-    else if (currentDepth == maxDepth){
-        decision = getMajorClass(&uv);
-        decisionReady = true;
-        #ifdef DTR_DEBUG_
-        DTR_DEBUG_PRINT("Max depth reached, decision is ");
-        DTR_DEBUG_PRINTLN(decision);
-        #endif
-        return 0;
+    return tree->costPenalty*tree->featureCosts[column];
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::pathRow(TFeature** X, RowsSubIndexes* rsi){
+    //Every row of the node took the same path, the ancestors already have their splits and children.
+    //A NaN is not ordered, the sort may have sent its row either way, so such rows are passed over
+    for(uint32_t j=0;j<rsi->size;j++){
+        uint32_t row = rsi->indexes[j];
+        Node* node = tree->root;
+        while(node!=this && node->children[0]!=NULL){
+            TFeature v = cell(X,row,node->nodeThColumn);
+            if(v!=v)break;
+            node = node->children[v<=node->nodeTh ? 0 : 1];
+        }
+        if(node==this)return row;
     }
- 
-    RowsSubIndexes rsiAboveTh;
-    RowsSubIndexes rsiBelowTh;
+    return 0xFFFFFFFF;
+}
 
-    T th;
-    uint32_t thColumn;
-    int16_t rslt = getBestSplit(X,Y,rsi,cols,&rsiAboveTh,&rsiBelowTh,&th,&thColumn);
-    if(rslt != CANT_SPLIT_ALL_THE_SAMPLES_HAVE_THE_SAME_VALUE){
-        children[0] = new Node(this->maxDepth,this->minSamplesSplit);
-        children[1] = new Node(this->maxDepth,this->minSamplesSplit);
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::parentColumn(TFeature** X, RowsSubIndexes* rsi, uint32_t cols){
+    uint32_t column = cols;
+    uint32_t row = pathRow(X,rsi);
+    if(row==0xFFFFFFFF)return cols;
+    for(Node* node=tree->root;node!=this;node=node->children[cell(X,row,node->nodeThColumn)<=node->nodeTh ? 0 : 1]){
+        column = node->nodeThColumn;
+    }
+    return column;
+}
 
-        children[0]->recurcisiveFit(X,Y,&rsiBelowTh,cols,currentDepth+1);
-        children[1]->recurcisiveFit(X,Y,&rsiAboveTh,cols,currentDepth+1);
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::columnAt(uint32_t k, uint32_t first, uint32_t cols){
+    if(first>=cols)return k;
+    if(k==0)return first;
+    return k<=first ? k-1 : k;
+}
 
-        nodeTh=th;
-        nodeThColumn=thColumn;
-        thReady = true;
-    }else{
-        decision = getMajorClass(&uv);
-        decisionReady = true;
+template < typename TFeature, typename TLabel, typename Allocator >
+bool TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::beats(float infoGain, uint32_t column, float bestInfoGain, uint32_t bestColumn){
+    //Equal gains go to the lower column, as if the columns were checked in order
+    return infoGain>bestInfoGain || (infoGain==bestInfoGain && column<bestColumn);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+float TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::perfectSplitGain(float entropyBeforeTheSplit){
+    //Both children pure, entropyFromCounts() of a single class is slightly below 0
+    uint32_t pure[1] = {2};
+    return entropyBeforeTheSplit - tree->outputs*entropyFromCounts(pure,1,2);
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::partition(TFeature** X, RowsSubIndexes* rsi, TFeature threshold, uint32_t column){
+    uint32_t i = 0;
+    uint32_t j = rsi->size;
+    while(i<j){
+        if(X[rsi->indexes[i]][column]<=threshold){
+            i++;
+        }else{
+            j--;
+            uint32_t t = rsi->indexes[i];
+            rsi->indexes[i] = rsi->indexes[j];
+            rsi->indexes[j] = t;
+        }
     }
-    return 0;
+    return i;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+TFeature TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::midpoint(TFeature a, TFeature b){
+    //a+(b-a)/2 rounds towards a for the integer types, (a+b)/2 would round negative values towards b
+    TFeature m = a + (b-a)/2;
+    if(!(m<b))m=a;
+    return m;
 }
 
-template < typename T >
-int16_t TinyDecisionTreeClassifier<T>::Node::getBestSplit(T** X,T** Y, RowsSubIndexes* rsi, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, T* threshold, uint32_t* column){
-    float entropyBeforeTheSplit=computeEntropy(Y,rsi);
+template < typename TFeature, typename TLabel, typename Allocator >
+int16_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::getExactSplit(TFeature** X, RowsSubIndexes* rsi, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column){
+    uint32_t classes = tree->totalClasses;
+    uint16_t outputs = tree->outputs;
     float entropyAbove;
     float entropyBelow;
     float infoGain;//A few operations can be saved by using Entropy directly without computing Y entropy
 
     //finding max
     float bestInfoGain=-FLT_MAX;
-    RowsSubIndexes currentRsiBelowTh;
-    RowsSubIndexes currentRsiAboveTh;
+    uint32_t bestSplit=0;
+
+    //Scratch buffers are allocated once per node and released in reverse order, so that arena allocators get them back
+    TFeature* sorted = (TFeature *)tree->allocator.allocate(rsi->size*sizeof(TFeature));
+    uint32_t* idxs = (uint32_t *)tree->allocator.allocate(rsi->size*sizeof(uint32_t));
+    uint32_t* counts = (uint32_t *)tree->allocator.allocate(3*classes*sizeof(uint32_t));
+    if(sorted==NULL || idxs==NULL || counts==NULL){
+        if(counts)tree->allocator.deallocate(counts,3*classes*sizeof(uint32_t));
+        if(idxs)tree->allocator.deallocate(idxs,rsi->size*sizeof(uint32_t));
+        if(sorted)tree->allocator.deallocate(sorted,rsi->size*sizeof(TFeature));
+        return NOT_ENOUGH_MEMORY;
+    }
+    uint32_t* countsBelow = counts+classes;
+    uint32_t* countsAbove = counts+2*classes;
+    uint32_t total = countClasses(rsi,counts);
+    float entropyBeforeTheSplit=impurity(counts,total);
+
+    float perfectGain=perfectSplitGain(entropyBeforeTheSplit);
 
-    for(uint32_t i=0;i<cols;i++){
-        //Sort the column
-        T* sorted = (T *)malloc(rsi->size*sizeof(T));
-        uint32_t* idxs = (uint32_t *)malloc(rsi->size*sizeof(uint32_t));
+    //Random feature subspace, selection sampling picks exactly featuresLeft columns without extra memory
+    uint32_t featuresLeft=tree->featuresPerSplit(cols);
+    bool allFeatures=(featuresLeft==cols);
+    uint32_t first=allFeatures ? parentColumn(X,rsi,cols) : cols;
+    for(uint32_t k=0;;k++){
+        if(k==cols){
+            //None of the chosen features can split the data, so all of them are checked
+            if(allFeatures || bestInfoGain!=-FLT_MAX)break;
+            allFeatures=true;
+            k=0;
+        }
+        if(!allFeatures){
+            if(tree->random(cols-k)>=featuresLeft)continue;
+            featuresLeft--;
+        }
+        uint32_t i = columnAt(k,first,cols);
+        float cost = splitCost(X,rsi,i);
+        //No split of the column can gain more than separating the classes completely
+        if(bestInfoGain!=-FLT_MAX && !beats(perfectGain-cost,i,bestInfoGain,*column))continue;
 
+        //Copy the column, constant and two-valued columns are found on the way and need no sorting
+        TFeature low = X[rsi->indexes[0]][i];
+        TFeature high = low;
+        bool twoValues = true;
         for(uint32_t j=0;j<rsi->size;j++){
-            sorted[j]=X[rsi->indexes[j]][i];
+            TFeature v = X[rsi->indexes[j]][i];
+            sorted[j]=v;
             idxs[j]=rsi->indexes[j];
+            if(v!=low && v!=high){
+                if(!(low!=high)){
+                    if(v<low)low=v;
+                    else high=v;
+                }else{
+                    twoValues=false;
+                }
+            }
+        }
+        if(twoValues && low==high)continue;
+        if(twoValues && low<high){
+            //The only threshold, the counts are the ones the scan would have at the first change of value
+            for(uint32_t c=0;c<classes;c++)countsBelow[c]=0;
+            uint32_t weightBelow=0;
+            uint32_t rowsBelow=0;
+            for(uint32_t j=0;j<rsi->size;j++){
+                if(sorted[j]!=low)continue;
+                uint16_t* rowClasses = tree->rowClasses+idxs[j]*outputs;
+                uint32_t w = tree->rowWeight(idxs[j]);
+                for(uint16_t o=0;o<outputs;o++){
+                    countsBelow[tree->classOffsets[o]+rowClasses[o]]+=w;
+                }
+                weightBelow+=w;
+                rowsBelow++;
+            }
+            for(uint32_t c=0;c<classes;c++)countsAbove[c]=counts[c]-countsBelow[c];
+            entropyBelow = impurity(countsBelow,weightBelow);
+            entropyAbove = impurity(countsAbove,total-weightBelow);
+            infoGain = entropyBeforeTheSplit - (entropyBelow*(((float)weightBelow)/((float)total))+entropyAbove*(((float)(total-weightBelow))/((float)total)))-cost;
+            if(beats(infoGain,i,bestInfoGain,*column)){
+                bestInfoGain=infoGain;
+                bestSplit=rowsBelow;
+                *threshold=midpoint(low,high);
+                *column=i;
+                partition(X,rsi,low,i);
+            }
+            continue;
         }
-        qsort(sorted,idxs,rsi->size);
+        TinySort<TFeature>::sort(sorted,idxs,rsi->size,&tree->allocator);
 
-        //Find where the values differ and check entropy (to find max for threshold generation)
+        //Rows are moved one by one from above to below the threshold, so the class counts of both sides are always known
+        for(uint32_t c=0;c<classes;c++){
+            countsBelow[c]=0;
+            countsAbove[c]=counts[c];
+        }
+        uint32_t weightBelow=0;
         for(uint32_t j=1;j<rsi->size;j++){
+            uint16_t* rowClasses = tree->rowClasses+idxs[j-1]*outputs;
+            uint32_t w = tree->rowWeight(idxs[j-1]);
+            for(uint16_t o=0;o<outputs;o++){
+                uint32_t c = tree->classOffsets[o]+rowClasses[o];
+                countsBelow[c]+=w;
+                countsAbove[c]-=w;
+            }
+            weightBelow+=w;
+            //Find where the values differ and check entropy (to find max for threshold generation)
             if(sorted[j]!=sorted[j-1]){
-                if(currentRsiBelowTh.indexes)free(currentRsiBelowTh.indexes);
-                currentRsiBelowTh.indexes=(uint32_t *)malloc(j*sizeof(uint32_t));
-                currentRsiBelowTh.size=j;
-                for(uint32_t k=0;k<j;k++){
-                    currentRsiBelowTh.indexes[k]=idxs[k];
-                }
-                entropyBelow = computeEntropy(Y,&currentRsiBelowTh);
+                entropyBelow = impurity(countsBelow,weightBelow);
+                entropyAbove = impurity(countsAbove,total-weightBelow);
 
-                if(currentRsiAboveTh.indexes)free(currentRsiAboveTh.indexes);
-                currentRsiAboveTh.indexes=(uint32_t *)malloc((rsi->size-j)*sizeof(uint32_t));
-                currentRsiAboveTh.size=(rsi->size-j);
-                for(uint32_t k=j;k<(rsi->size);k++){
-                    currentRsiAboveTh.indexes[k-j]=idxs[k];
-                }
-                entropyAbove = computeEntropy(Y,&currentRsiAboveTh);
-
-                infoGain = entropyBeforeTheSplit - (entropyBelow*(((float)j)/((float)rsi->size))+entropyAbove*(((float)(rsi->size-j))/((float)rsi->size)));
-                if(infoGain>bestInfoGain){
+                infoGain = entropyBeforeTheSplit - (entropyBelow*(((float)weightBelow)/((float)total))+entropyAbove*(((float)(total-weightBelow))/((float)total)))-cost;
+                if(beats(infoGain,i,bestInfoGain,*column)){
                     bestInfoGain=infoGain;
-                    *threshold=(sorted[j-1] + sorted[j])/2;
+                    bestSplit=j;
+                    *threshold=midpoint(sorted[j-1],sorted[j]);
                     *column=i;
 
-                    if(rsiBelowTh->indexes)free(rsiBelowTh->indexes);
-                    rsiBelowTh->indexes=(uint32_t*)malloc(j*sizeof(uint32_t));
-                    rsiBelowTh->size=j;
-                    for(uint32_t k=0;k<j;k++){
-                        rsiBelowTh->indexes[k]=idxs[k];
-                    }
-
-                    if(rsiAboveTh->indexes)free(rsiAboveTh->indexes);
-                    rsiAboveTh->indexes=(uint32_t*)malloc((rsi->size-j)*sizeof(uint32_t));
-                    rsiAboveTh->size=(rsi->size-j);
-                    for(uint32_t k=j;k<(rsi->size);k++){
-                        rsiAboveTh->indexes[k-j]=idxs[k];
+                    //The order of the rows doesn't matter for the next columns, so the best one is kept in place
+                    for(uint32_t k=0;k<rsi->size;k++){
+                        rsi->indexes[k]=idxs[k];
                     }
                 }
             }
         }
-        free(sorted);
-        free(idxs);
     }
+    tree->allocator.deallocate(counts,3*classes*sizeof(uint32_t));
+    tree->allocator.deallocate(idxs,rsi->size*sizeof(uint32_t));
+    tree->allocator.deallocate(sorted,rsi->size*sizeof(TFeature));
+
     if(bestInfoGain==-FLT_MAX){
         #ifdef DTR_DEBUG_
         DTR_DEBUG_PRINT("Can't split all the samples have the same value");
         #endif
         return CANT_SPLIT_ALL_THE_SAMPLES_HAVE_THE_SAME_VALUE;
     }
+    rsiBelowTh->indexes=rsi->indexes;
+    rsiBelowTh->size=bestSplit;
+    rsiAboveTh->indexes=rsi->indexes+bestSplit;
+    rsiAboveTh->size=rsi->size-bestSplit;
     #ifdef DTR_DEBUG_
     DTR_DEBUG_PRINT("Best split in column ");
     DTR_DEBUG_PRINT(*column);
@@ -259,132 +2001,20 @@ int16_t TinyDecisionTreeClassifier<T>::Node::getBestSplit(T** X,T** Y, RowsSubIn
     return 0;
 }
 
-template < typename T >
-float TinyDecisionTreeClassifier<T>::Node::computeEntropy(T** Y, RowsSubIndexes* rsi){
+template < typename TFeature, typename TLabel, typename Allocator >
+float TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::entropyFromCounts(uint32_t* counts, uint32_t classes, uint32_t total){
     float entropy=0;
-    if(rsi->size<2){
-        return 0;
-    }
-    else{
-        UniqueValues uv;
-        countUniqueValuesAndOccurances(Y,rsi,0,&uv);
-        for(uint32_t i = 0;i<uv.uniqueValuesSize;i++){
-            float freq = ((float)(uv.uniqueValuesOccurances[i]))/rsi->size;
-            entropy += -(freq*(log(freq+1e-6)/log(2)));
-        }
+    if(total<2)return 0;
+    for(uint32_t i = 0;i<classes;i++){
+        if(counts[i]==0)continue;
+        float freq = ((float)(counts[i]))/total;
+        entropy += -(freq*(log(freq+1e-6)/log(2)));
     }
     return entropy;
 }
 
-template < typename T >
-void TinyDecisionTreeClassifier<T>::Node::countUniqueValuesAndOccurances(T ** ar, RowsSubIndexes* rsi, uint32_t column, UniqueValues* uv){
-    T* sorted = (T *)malloc(rsi->size*sizeof(T));
-
-    for(uint32_t i=0;i<rsi->size;i++){
-        sorted[i]=ar[rsi->indexes[i]][column];
-    }
-    qsort(sorted,rsi->size);
-    
-    uv->uniqueValues = (T *)malloc(1*sizeof(T));
-    uv->uniqueValuesOccurances = (uint32_t *)malloc(1*sizeof(uint32_t));
-    uv->uniqueValues[0] = sorted[0];
-    uv->uniqueValuesSize = 1;
-    uv->uniqueValuesOccurances[0]=1;
-
-    for (uint16_t i=1;i<rsi->size;i++){
-        if(sorted[i]!=sorted[i-1]){
-            uv->uniqueValues = (T *)realloc(uv->uniqueValues,(uv->uniqueValuesSize+1)*sizeof(T));
-            uv->uniqueValuesOccurances = (uint32_t *)realloc(uv->uniqueValuesOccurances,(uv->uniqueValuesSize+1)*sizeof(uint32_t));
-            uv->uniqueValuesOccurances[uv->uniqueValuesSize]=1;
-            uv->uniqueValues[uv->uniqueValuesSize]=sorted[i];
-            uv->uniqueValuesSize++;
-        }else{
-            uv->uniqueValuesOccurances[uv->uniqueValuesSize-1]++;
-        }
-    }
-    free(sorted);
-}
-
-template < typename T >
-void TinyDecisionTreeClassifier<T>::Node::qsort(T *ar, uint32_t n) 
-{
-    if (n < 2)
-        return;
-    T p = ar[n / 2];
-    T *l = ar;
-    T *r = ar + n - 1;
-    while (l <= r) {
-    if (*l < p) {
-        l++;
-    }
-    else if (*r > p) {
-        r--;
-    }
-    else {
-        int t = *l;
-        *l = *r;
-        *r = t;
-        l++;
-        r--;
-    }
-    }
-    qsort(ar, r - ar + 1);
-    qsort(l, ar + n - l);
-}
-
-template < typename T >
-void TinyDecisionTreeClassifier<T>::Node::qsort(T *ar, uint32_t *idx, uint32_t n) 
-{
-    if (n < 2)
-        return;
-    T p = ar[n / 2];
-    T *l = ar;
-    T *r = ar + n - 1;
-    uint32_t *li = idx;
-    uint32_t *ri = idx + n - 1;
-
-
-    while (l <= r) {
-    if (*l < p) {
-        l++;
-        li++;
-    }
-    else if (*r > p) {
-        r--;
-        ri--;
-    }
-    else {
-        int t = *l;
-        *l = *r;
-        *r = t;
-        l++;
-        r--;
-        uint32_t ti = *li;
-        *li = *ri;
-        *ri = ti;
-        li++;
-        ri--;
-    }
-    }
-    qsort(ar, idx, r - ar + 1);
-    qsort(l, li, ar + n - l);
-}
-
-template < typename T >
-T TinyDecisionTreeClassifier<T>::Node::getMajorClass(UniqueValues* uv){
-    uint32_t maxOcc=0;
-    uint32_t maxOccIdx=0; 
-    for(uint32_t i=0;i<uv->uniqueValuesSize;i++){
-        if(uv->uniqueValuesOccurances[i]>maxOcc){
-            maxOcc=uv->uniqueValuesOccurances[i];
-            maxOccIdx=i;
-        }
-    }
-    return uv->uniqueValues[maxOccIdx];
-}
-
-template < typename T >
-T TinyDecisionTreeClassifier<T>::Node::decide(T* X){
+template < typename TFeature, typename TLabel, typename Allocator >
+TLabel TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::decide(TFeature* X){
     if(decisionReady)return decision;
     else{
         if(thReady){
@@ -411,14 +2041,96 @@ T TinyDecisionTreeClassifier<T>::Node::decide(T* X){
     }
 }
 
-template < typename T >
-void TinyDecisionTreeClassifier<T>::Node::cleanup(){
+template < typename TFeature, typename TLabel, typename Allocator >
+size_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::cleanup(){
+    size_t freed = 0;
     if(children[0]!=NULL){
         for(uint32_t i=0;i<2;i++){
-            children[i]->cleanup();
-            delete children[i];
+            freed += tree->releaseNode(children[i]);
+            children[i]=NULL;
+        }
+    }
+    return freed;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::hash(){
+    //FNV-1a over the bytes of the fields that decide the routing
+    uint32_t h = 2166136261u;
+    const uint8_t* bytes;
+    uint32_t n;
+    if(children[0]!=NULL){
+        bytes = (const uint8_t*)&nodeTh;
+        n = sizeof(TFeature);
+        for(uint32_t i=0;i<n;i++)h = (h^bytes[i])*16777619u;
+        bytes = (const uint8_t*)&nodeThColumn;
+        n = sizeof(uint32_t);
+        for(uint32_t i=0;i<n;i++)h = (h^bytes[i])*16777619u;
+        bytes = (const uint8_t*)children;
+        n = sizeof(children);
+    }else if(decisions){
+        bytes = (const uint8_t*)decisions;
+        n = tree->outputs*sizeof(TLabel);
+    }else{
+        bytes = (const uint8_t*)&decision;
+        n = sizeof(TLabel);
+    }
+    for(uint32_t i=0;i<n;i++)h = (h^bytes[i])*16777619u;
+    return h;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+bool TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::sameAs(Node* other){
+    if((children[0]==NULL)!=(other->children[0]==NULL))return false;
+    if(children[0]!=NULL){
+        return nodeThColumn==other->nodeThColumn && memcmp(&nodeTh,&other->nodeTh,sizeof(TFeature))==0 &&
+            children[0]==other->children[0] && children[1]==other->children[1];
+    }
+    if(decisionReady!=other->decisionReady)return false;
+    if(decisions){
+        return memcmp(decisions,other->decisions,tree->outputs*sizeof(TLabel))==0;
+    }
+    return memcmp(&decision,&other->decision,sizeof(TLabel))==0;
+}
+
+template < typename TFeature, typename TLabel, typename Allocator >
+uint32_t TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>::Node::prune(TFeature** X, TLabel** Y, RowsSubIndexes* rsi, float alphaTotal, uint32_t* leaves, size_t* freed){
+    //Errors the node would make as a leaf, every internal node keeps its majority decision for that
+    uint32_t errors = 0;
+    for(uint32_t i=0;i<rsi->size;i++){
+        TLabel* y = Y[rsi->indexes[i]];
+        if(decisions){
+            for(uint16_t o=0;o<tree->outputs;o++){
+                if(decisions[o]!=y[o])errors++;
+            }
+        }else if(decision!=y[0]){
+            errors++;
         }
     }
+    *leaves = 1;
+    if(decisionReady || children[0]==NULL)return errors;
+
+    //The children are pruned first, so the weakest links go before their parents
+    uint32_t below = partition(X,rsi,nodeTh,nodeThColumn);
+    RowsSubIndexes rsiBelowTh;
+    RowsSubIndexes rsiAboveTh;
+    rsiBelowTh.indexes=rsi->indexes;
+    rsiBelowTh.size=below;
+    rsiAboveTh.indexes=rsi->indexes+below;
+    rsiAboveTh.size=rsi->size-below;
+    uint32_t leavesBelow;
+    uint32_t leavesAbove;
+    uint32_t subtreeErrors = children[0]->prune(X,Y,&rsiBelowTh,alphaTotal,&leavesBelow,freed);
+    subtreeErrors += children[1]->prune(X,Y,&rsiAboveTh,alphaTotal,&leavesAbove,freed);
+
+    if((float)errors-(float)subtreeErrors<=alphaTotal*(leavesBelow+leavesAbove-1)){
+        *freed += cleanup();
+        thReady = false;
+        decisionReady = true;
+        return errors;
+    }
+    *leaves = leavesBelow+leavesAbove;
+    return subtreeErrors;
 }
 
 #endif
\ No newline at end of file
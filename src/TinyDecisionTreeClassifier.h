@@ -20,8 +20,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include "math.h"
 #include "float.h"
+#include "TinyDecisionTreeAllocators.h"
+#include "TinyDecisionTreeSort.h"
 
 // #define DTR_DEBUG_
 #ifdef ARDUINO
@@ -34,95 +37,181 @@
 #endif
 
 #define CANT_SPLIT_ALL_THE_SAMPLES_HAVE_THE_SAME_VALUE  -1
+#define NOT_ENOUGH_MEMORY                               -2
+#define INVALID_MODEL                                   -4
+
+/** @brief Model format of exportModel/importModel.**/
+#define DTR_MODEL_MAGIC                                 0x32544454
+#define DTR_MODEL_HEADER_SIZE                           20
+#define DTR_MODEL_LEAF                                  0xFFFFFFFF
+
+/** @brief Special values of maxFeatures, any other value is the number of features checked per node.**/
+#define DTR_MAX_FEATURES_ALL                            0
+#define DTR_MAX_FEATURES_SQRT                           0xFFFF
+#define DTR_MAX_FEATURES_LOG2                           0xFFFE
+
+/** @brief Number of features the lazy predict() remembers per call, the features tested further down a longer path are requested again when they repeat.**/
+#ifndef DTR_LAZY_FEATURES
+    #define DTR_LAZY_FEATURES                           16
+#endif
+
+/** @brief Values of splitMode.**/
+#define DTR_SPLIT_BEST                                  0
+#define DTR_SPLIT_RANDOM                                1
+
+/** @brief Samples in compressed sparse row (CSR) format, for features that are mostly 0 (event counters, one-hot states).
+ * The nonzero values of row r are values[rowStart[r]..rowStart[r+1]) and their columns are columns[rowStart[r]..rowStart[r+1]), in increasing order.
+ * All the other values are 0.
+ **/
+template <typename TFeature>
+struct TinySparseRows{
+    const uint32_t* rowStart;
+    const uint32_t* columns;
+    const TFeature* values;
+
+    /** @brief Value of a cell, found by a binary search in its row.**/
+    TFeature value(uint32_t row, uint32_t column) const{
+        uint32_t low = rowStart[row];
+        uint32_t high = rowStart[row+1];
+        while(low<high){
+            uint32_t middle = low+(high-low)/2;
+            if(columns[middle]<column)low = middle+1;
+            else high = middle;
+        }
+        return low<rowStart[row+1] && columns[low]==column ? values[low] : (TFeature)0;
+    }
+};
+
+/** @brief isRow is true for the pointer types predict(TFeature* X) takes, the lazy predict() only accepts the other types as providers.**/
+template <typename T, typename TFeature>
+struct TinyFeatureRow{
+    static const bool isRow = false;
+};
+
+template <typename TFeature>
+struct TinyFeatureRow<TFeature*,TFeature>{
+    static const bool isRow = true;
+};
+
+template <typename TFeature>
+struct TinyFeatureRow<const TFeature*,TFeature>{
+    static const bool isRow = true;
+};
+
+/** @brief type is T only when enabled, the missing type removes a template overload (no <type_traits> on AVR).**/
+template <bool enabled, typename T>
+struct TinyEnableIf{};
 
-/** @brief The main classifier class, the tempate T allows changing the datatype of the input data. Also 8-bit MCUs work faster with int8_t data type**/
 template <typename T>
+struct TinyEnableIf<true,T>{
+    typedef T type;
+};
+
+/** @brief The main classifier class, the tempate TFeature allows changing the datatype of the input data. Also 8-bit MCUs work faster with int8_t data type.
+ * The template TLabel is the datatype of the classes, 1-byte labels (the default) take the least memory and are counted with a lookup table instead of sorting.
+ * The template Allocator is the allocator policy used for every node, index array and scratch buffer (see TinyDecisionTreeAllocators.h).**/
+template <typename TFeature, typename TLabel = uint8_t, typename Allocator = TinyMallocAllocator>
 class TinyDecisionTreeClassifier{
     public:
     uint16_t maxDepth;
     uint16_t minSamplesSplit;
+    /** @brief How many randomly chosen features are checked at each node: a number, DTR_MAX_FEATURES_SQRT, DTR_MAX_FEATURES_LOG2 or DTR_MAX_FEATURES_ALL.**/
+    uint16_t maxFeatures=DTR_MAX_FEATURES_ALL;
+    /** @brief Nodes with more rows than this search the threshold on a random sample of subsampleSize rows, 0 disables sampling.**/
+    uint32_t subsampleThreshold=0;
+    /** @brief Number of rows used to search the threshold in the nodes above subsampleThreshold.**/
+    uint32_t subsampleSize=1024;
+    /** @brief DTR_SPLIT_BEST checks every threshold, DTR_SPLIT_RANDOM (extremely randomized trees) checks randomSplitsPerFeature random thresholds per feature and doesn't sort anything.**/
+    uint8_t splitMode=DTR_SPLIT_BEST;
+    /** @brief Number of random thresholds checked per feature in DTR_SPLIT_RANDOM mode, 0 is taken as 1.**/
+    uint8_t randomSplitsPerFeature=1;
+    /** @brief Seed of the random generator, the same seed and data give the same tree.**/
+    uint32_t randomSeed=1;
+    /** @brief Optional cost of computing every feature (one value per column), e.g. the CPU time of an FFT band versus a mean. NULL means all the features cost the same.**/
+    const float* featureCosts=NULL;
+    /** @brief The splits maximize the information gain minus costPenalty*featureCosts[column]. A feature already tested above the node is free, the lazy predict() computes it only once.**/
+    float costPenalty=0;
+    /** @brief If true, fit merges identical rows (features and labels) into one weighted row, so the training cost depends on the number of distinct rows.**/
+    bool collapseDuplicates=false;
+    /** @brief If true, the nodes of the previous tree are kept on a free list by the next fit (or importModel) and reused instead of being returned to the allocator, so retraining doesn't fragment the heap. releaseFreeNodes() gives them back.**/
+    bool reuseNodes=false;
     bool trained=false;
+    /** @brief Number of input columns of the fitted or imported tree, predict() reads X[0..columns-1].**/
+    uint32_t columns=0;
+
+    /** @brief Memory used by the tree, can be configured before calling fit (e.g. arena buffer) and queried after (e.g. peak usage).**/
+    Allocator allocator;
 
     /** @brief Nested node class**/
     class Node{
+        friend class TinyDecisionTreeClassifier;
         private:
-        uint16_t maxDepth;
-        uint16_t minSamplesSplit;
-        struct UniqueValues
-        {
-            T* uniqueValues=NULL;
-            uint32_t uniqueValuesSize=0;
-            uint32_t* uniqueValuesOccurances=NULL;
-            ~UniqueValues(){
-                if(uniqueValues)free(uniqueValues);
-                if(uniqueValuesOccurances)free(uniqueValuesOccurances);
-            }
-        };
-
-        /** @brief Quicksort is used for sorting the data to split the data by threholds. The data are sorted in place.
-         * @param ar A pointer to array of data to sort.
-         * @param n Array size
-          **/                
-        void qsort(T * ar,uint32_t n);
-
-        /** @brief Quicksort is used for sorting the data to split the data by threholds. The data are sorted in place.
-         * @param ar A pointer to array of data to sort.
-         * @param n Array size
-         * @param idx Pointer to an array of indices, that describes which index ended up where after the sort
-          **/                
-        void qsort(T * ar, uint32_t* idx,uint32_t n);
-
-        /** @brief Returns the most frequent class.
-         * @param uv A pointer to array of data to sort.
-          **/                
-        T getMajorClass(UniqueValues* uv);
-
+        TinyDecisionTreeClassifier* tree;
         public:
         
         /** @brief Child nodes.**/                
-        Node* children[2] = {NULL,NULL};
-        bool decisionReady = false;
-        T decision;
-        bool thReady = false;
-        T nodeTh;
+        Node* children[2];
+        bool decisionReady;
+        /** @brief Majority class of the node (of the first output).**/                
+        TLabel decision;
+        /** @brief Majority class of every output, only allocated when the tree has more than one output.**/                
+        TLabel* decisions;
+        bool thReady;
+        TFeature nodeTh;
         uint32_t nodeThColumn;
+        /** @brief Number of references to the node (parents and the tree root), more than 1 after compact() merged identical subtrees.**/                
+        uint32_t parents;
 
-        /** @brief Used to pass information about which data to work with.**/                
+        /** @brief Used to pass information about which data to work with. Doesn't own the indexes, the children work on the subranges of the parent's array.**/                
         struct RowsSubIndexes
         {
             uint32_t size=0;
             uint32_t* indexes=NULL;
-            ~RowsSubIndexes(){
-                if(indexes)free(indexes);
-            }
         };
 
-        /** @brief Recursively builds the tree, generating the best split by maximizing information gain.
-         * @param minSamplesSplit If the number of samples is less than this number the splitting process stops.
-         * @param maxDepth Maximum possible depth of a tree.
+        /** @brief Initializes the node, nodes are allocated with the tree allocator so there is no constructor.
+         * @param tree The tree the node belongs to, provides the hyperparameters and the allocator.
+        **/                
+        void init(TinyDecisionTreeClassifier* tree);
+
+        /** @brief Moves the subtree to another classifier object (after the classifier was moved).
+         * @param tree The new owner.
         **/                
-        Node(uint16_t maxDepth, uint16_t minSamplesSplit = 2);
+        void adopt(TinyDecisionTreeClassifier* tree);
 
-        /** @brief Recursively builds the tree, generating the best split by maximizing information gain.
+        /** @brief Sets the decisions of the node and splits it by the best split (maximizing information gain) if it can be split. The children are not fitted, step() puts them on the frontier.
          * @param X Input samples.
-         * @param Y Input classes.
          * @param rsi Indicies of rows to work with.
          * @param cols Total number of input samples columns (basically the number of input features).
-         * @param current_depth Since the method is called recursively this argument tracks the current depth.
+         * @param currentDepth Depth of the node, the root is at depth 1.
+         * @param rsiBelowTh Output variable, rows of children[0].
+         * @param rsiAboveTh Output variable, rows of children[1].
+         * @return True if the node got children. False with fitOutOfMemory set if the node couldn't even get its decisions.
         **/                
-        int16_t recurcisiveFit(T** X,T** Y, RowsSubIndexes* rsi, uint32_t cols, uint32_t current_depth);
+        bool expand(TFeature** X, RowsSubIndexes* rsi, uint32_t cols, uint32_t currentDepth, RowsSubIndexes* rsiBelowTh, RowsSubIndexes* rsiAboveTh);
 
-        /** @brief Checks how many unique values does the columm have. Used to calculate Shannons entropy.
-         * @param ar All the input data.
+        /** @brief Counts the rows of every class of every output (weighted), the classes of output o start at classOffsets[o].
          * @param rsi Which rows to process.
-         * @param column Which column to process.
-         * @param uv A pointer to the output variable to fill in the data.
+         * @param counts Output variable, totalClasses counters.
+         * @return Total weight of the rows.
+        **/                
+        uint32_t countClasses(RowsSubIndexes* rsi, uint32_t* counts);
+
+        /** @brief Sets decision (and decisions) to the most frequent class of every output.
+         * @param counts Class counts filled by countClasses.
+         * @param total Total weight of the rows.
+         * @return True if every output has only one class.
         **/                
-        void countUniqueValuesAndOccurances(T** ar, RowsSubIndexes* rsi, uint32_t column, UniqueValues* uv);
+        bool setDecisions(uint32_t* counts, uint32_t total);
 
-        /** @brief Generates the split that maximizes information gain. 
+        /** @brief Sum of Shannon's entropies of all the outputs.
+         * @param counts Class counts filled by countClasses.
+         * @param total Total weight of the rows.
+        **/                
+        float impurity(uint32_t* counts, uint32_t total);
+
+        /** @brief Generates the split that maximizes information gain. The rows of rowsToProcess are reordered in place so that rsiBelowTh and rsiAboveTh are its subranges.
          * @param X Input samples.
-         * @param Y Input classes.
          * @param rowsToProcess Which rows to process.
          * @param cols Total number of input samples columns (basically the number of input features).
          * @param rsiAboveTh Output variable, rows above threhold
@@ -130,24 +219,293 @@ class TinyDecisionTreeClassifier{
          * @param threshold Output variable, a pointer to the best threhold.(returned after method ends)
          * @param column Output variable, a column of the best split(returned after method ends)
         **/                
-        int16_t getBestSplit(T** X,T** Y, RowsSubIndexes* rowsToProcess, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, T* threshold, uint32_t* column);
+        int16_t getBestSplit(TFeature** X, RowsSubIndexes* rowsToProcess, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column);
 
-        /** @brief Compute Shannon's entropy.
-         * @param Y Input column.
+        /** @brief Cost penalty of splitting the node by the column, 0 if one of the ancestors tests it already. The ancestors are found by walking a row of the node (pathRow) down from the root.
+         * @param X Input samples.
+         * @param rsi Rows of the node.
+         * @param column The feature.
+        **/                
+        float splitCost(TFeature** X, RowsSubIndexes* rsi, uint32_t column);
+
+        /** @brief A row of the node that leads from the root to it by comparing with the thresholds of the ancestors.
+         * @param X Input samples.
+         * @param rsi Rows of the node.
+         * @return The row, 0xFFFFFFFF if every row has a NaN on the way.
+        **/                
+        uint32_t pathRow(TFeature** X, RowsSubIndexes* rsi);
+
+        /** @brief Value of a cell of the samples of the fit in progress, dense X or the sparse rows of a sparse fit.**/                
+        TFeature cell(TFeature** X, uint32_t row, uint32_t column){
+            return tree->fitSparse.rowStart!=NULL ? tree->fitSparse.value(row,column) : X[row][column];
+        }
+
+        /** @brief Column of the split of the parent node (found with pathRow), cols for the root or if it can't be found. Its children are often split by the same feature, so it is checked first.**/                
+        uint32_t parentColumn(TFeature** X, RowsSubIndexes* rsi, uint32_t cols);
+
+        /** @brief The column checked k-th when first is checked before all the others (cols for none).**/                
+        static uint32_t columnAt(uint32_t k, uint32_t first, uint32_t cols);
+
+        /** @brief True if a split of the column with the gain replaces the best one so far, the lower column wins a tie.**/                
+        static bool beats(float infoGain, uint32_t column, float bestInfoGain, uint32_t bestColumn);
+
+        /** @brief Information gain of a split that leaves both children pure, no split of the node can gain more (before the feature cost).**/                
+        float perfectSplitGain(float entropyBeforeTheSplit);
+
+        /** @brief Checks every threshold of every (chosen) feature, the arguments are the same as for getBestSplit.
+         * Branch and bound: the column of the parent split goes first, a column is skipped when even a perfect split of it can't beat the best one so far,
+         * constant columns are skipped and two-valued columns are evaluated without sorting.
+        **/                
+        int16_t getExactSplit(TFeature** X, RowsSubIndexes* rowsToProcess, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column);
+
+        /** @brief Split search of fitPresorted, scans the presorted rows of every (chosen) feature and stable-partitions all the lists by the best threshold, the arguments are the same as for getBestSplit.**/                
+        int16_t getPresortedSplit(TFeature** X, RowsSubIndexes* rowsToProcess, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column);
+
+        /** @brief Finds the split on a random sample of subsampleSize rows and partitions all the rows by it, the arguments are the same as for getBestSplit.**/                
+        int16_t getSubsampledSplit(TFeature** X, RowsSubIndexes* rowsToProcess, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column);
+
+        /** @brief Split search of a sparse fit, the same splits as getExactSplit. Only the nonzero values of the node are sorted, the rows with a 0 in the column
+         * are one group whose class counts are the counts of the node minus the nonzero rows. X is not used, the arguments are the same as for getBestSplit.
+        **/                
+        int16_t getSparseSplit(TFeature** X, RowsSubIndexes* rowsToProcess, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column);
+
+        /** @brief Draws random thresholds between min and max of each (chosen) feature and keeps the best one, the arguments are the same as for getBestSplit.**/                
+        int16_t getRandomSplit(TFeature** X, RowsSubIndexes* rowsToProcess, uint32_t cols, RowsSubIndexes* rsiAboveTh, RowsSubIndexes* rsiBelowTh, TFeature* threshold, uint32_t* column);
+
+        /** @brief Reorders the rows in place so that the ones with X[column]<=threshold come first.
+         * @param X Input samples.
          * @param rowsToProcess Which rows to process.
+         * @param threshold Split threshold.
+         * @param column Split column.
+         * @return Number of rows below or equal to the threshold.
+        **/                
+        uint32_t partition(TFeature** X, RowsSubIndexes* rowsToProcess, TFeature threshold, uint32_t column);
+
+        /** @brief Threshold between two neighbouring sorted values, a<=threshold<b so that decide() sends them the same way as the training did.**/                
+        static TFeature midpoint(TFeature a, TFeature b);
+
+        /** @brief Compute Shannon's entropy from class counts.
+         * @param counts Number of samples of each class.
+         * @param classes Number of classes.
+         * @param total Sum of the counts.
         **/                
-        float computeEntropy(T** Y,RowsSubIndexes* rowsToProcess);
+        static float entropyFromCounts(uint32_t* counts, uint32_t classes, uint32_t total);
 
         /** @brief Recursively make a decision about the output class.
          * @param X Input sample.
         **/                
-        T decide(T *X);
+        TLabel decide(TFeature *X);
+
+        /** @brief Recursively destroys the nodes and deallocates the memory
+         * @return Number of bytes returned to the allocator.
+        **/                
+        size_t cleanup(void);
 
-        /** @brief Recursively destroys the nodes and deallocates the memory**/                
-        void cleanup(void);
+        /** @brief Hash of the node fields and its children addresses, used by compact().**/                
+        uint32_t hash(void);
+
+        /** @brief Checks if the node makes the same decisions as another one, assuming identical children were already merged.
+         * @param other The node to compare with.
+        **/                
+        bool sameAs(Node* other);
+
+        /** @brief Recursively prunes the subtree bottom-up, a node becomes a leaf if its errors exceed the errors of its subtree by at most alpha*total*(leaves-1).
+         * @param X Input samples.
+         * @param Y Input classes.
+         * @param rsi Rows that reach the node, reordered in place.
+         * @param alphaTotal alpha multiplied by the total number of rows.
+         * @param leaves Output variable, number of leaves of the pruned subtree.
+         * @param freed Output variable, incremented by the number of bytes returned to the allocator.
+         * @return Number of errors of the pruned subtree on the rows.
+        **/                
+        uint32_t prune(TFeature** X, TLabel** Y, RowsSubIndexes* rsi, float alphaTotal, uint32_t* leaves, size_t* freed);
         };
         
         Node* root;
+        uint32_t randomState;
+        /** @brief Distance between the presorted lists of two neighbouring columns, 0 if the tree is not fitted by fitPresorted.**/
+        uint32_t presortedStride=0;
+        /** @brief Number of outputs of the trained tree.**/
+        uint16_t outputs=1;
+        /** @brief Sorted unique labels of every output, only valid during fit.**/
+        TLabel* classLabels=NULL;
+        uint32_t classLabelsCapacity=0;
+        /** @brief The labels of output o are classLabels[classOffsets[o]..classOffsets[o+1]), only valid during fit.**/
+        uint32_t* classOffsets=NULL;
+        uint32_t totalClasses=0;
+        /** @brief Index of the class of every row and output in classLabels (relative to classOffsets), only valid during fit.**/
+        uint16_t* rowClasses=NULL;
+        /** @brief Weight of every row, only valid during fit, NULL if every row weighs 1.**/
+        uint32_t* rowWeights=NULL;
+
+        /** @brief A node waiting to be expanded by step().**/
+        struct FitTask{
+            Node* node;
+            typename Node::RowsSubIndexes rsi;
+            uint32_t depth;
+        };
+        /** @brief State of beginFit/step: the frontier is a stack, so the nodes are expanded depth first in the same order as a recursive fit.**/
+        FitTask* frontier=NULL;
+        uint32_t frontierSize=0;
+        uint32_t frontierCapacity=0;
+        bool fitting=false;
+        TFeature** fitX=NULL;
+        /** @brief Samples of a sparse fit, rowStart is NULL for the dense ones.**/
+        TinySparseRows<TFeature> fitSparse={NULL,NULL,NULL};
+        uint32_t fitCols=0;
+        /** @brief Set when a node of the fit in progress has no decisions for lack of memory, the fit ends untrained.**/
+        bool fitOutOfMemory=false;
+        /** @brief Number of rows of X and Y of the fit in progress.**/
+        uint32_t fitRowsCount=0;
+        /** @brief Row indexes owned by the fit in progress, NULL for fitPresorted.**/
+        uint32_t* fitIndexes=NULL;
+
+        /** @brief Weight of a row during fit.**/
+        uint32_t rowWeight(uint32_t row){
+            return rowWeights ? rowWeights[row] : 1;
+        }
+
+        /** @brief Allocates the root rows of a fit (and the weights if there are any), the parts of beginFit the sparse fit shares.
+         * @param rows Number or samples.
+         * @param weights Weight of every row, NULL for 1.
+         * @param weighted Allocates the weights even if they are all 1.
+         * @param rsi Output variable, all the rows.
+         * @return 0 or NOT_ENOUGH_MEMORY.
+        **/                
+        int16_t beginIndexes(uint32_t rows, const uint32_t* weights, bool weighted, typename Node::RowsSubIndexes* rsi);
+
+        /** @brief Provider of the lazy predict() for one sparse row.**/
+        struct SparseRow{
+            const TinySparseRows<TFeature>* X;
+            uint32_t row;
+            TFeature operator()(uint32_t column){
+                return X->value(row,column);
+            }
+        };
+
+        /** @brief Merges the identical rows of rootRsi with a hash table, the first row of every group is kept and gets the sum of the weights.
+         * @param rsi The rows, shrunk to the distinct ones in place.
+         * @param weights Input and output variable, the weight of every row.
+         * @return False if there is not enough memory for the hash table, the rows are left as they are.
+        **/                
+        bool collapseRows(TFeature** X, TLabel** Y, typename Node::RowsSubIndexes* rsi, uint32_t* weights, uint32_t cols, uint16_t outputs);
+
+        /** @brief Builds classLabels, classOffsets and rowClasses so that the nodes count classes instead of sorting labels.
+         * @param Y Input classes.
+         * @param rows Number or samples.
+         * @return False if there is not enough memory or an output has more than 65535 classes.
+        **/                
+        bool encodeClasses(TLabel** Y, uint32_t rows);
+
+        /** @brief Frees the buffers of encodeClasses.
+         * @param rows Number or samples.
+        **/                
+        void releaseClasses(uint32_t rows);
+
+        /** @brief Allocates and initializes a node with the tree allocator.
+         * @return The new node or NULL if the allocator is out of memory.
+        **/                
+        Node* createNode(void);
+
+        /** @brief Returns the node memory to the tree allocator.
+         * @param node The node to destroy, its children should be cleaned up first.
+         * @return Number of bytes returned to the allocator.
+        **/                
+        size_t destroyNode(Node* node);
+
+        /** @brief Drops a reference to the node, the node and its subtree are destroyed when no references are left.
+         * @param node The node to release.
+         * @return Number of bytes returned to the allocator.
+        **/                
+        size_t releaseNode(Node* node);
+
+        /** @brief Drops a reference to the node like releaseNode, but the nodes go to the free list instead of the allocator.
+         * @param node The node to recycle.
+        **/                
+        void recycleNode(Node* node);
+
+        /** @brief Releases or recycles (reuseNodes) the trained tree before it is replaced.**/                
+        void dropTree(void);
+
+        /** @brief Nodes of the previous tree waiting to be reused, linked through children[0]. They keep their decisions arrays (sized for outputs).**/
+        Node* freeNodes=NULL;
+        uint32_t freeNodesCount=0;
+
+        /** @brief Contiguous node storage made by relayout(), NULL while the nodes are allocated one by one. All the nodes of the tree are in it when it is set.**/
+        Node* nodeBlock=NULL;
+        uint32_t nodeBlockSize=0;
+        /** @brief Profile of predict() after beginProfile(): branchCounts[2*i+b] counts how often node nodeBlock[i] took children[b], leaves count their visits in branchCounts[2*i].**/
+        uint32_t* branchCounts=NULL;
+
+        /** @brief True if the node is stored in nodeBlock and must not be freed on its own.**/
+        bool inBlock(Node* node){
+            return node>=nodeBlock && node<nodeBlock+nodeBlockSize;
+        }
+
+        /** @brief Frees nodeBlock and branchCounts, the tree must have been released already.**/
+        void releaseBlock(void);
+
+        /** @brief Walks the tree down to the leaf and counts the branches taken.
+         * @param X Input sample.
+        **/
+        Node* profiledLeaf(TFeature* X);
+
+        /** @brief Walks the tree down to the leaf and asks the provider only for the features tested on the way, each of them once.
+         * @param feature Feature provider, feature(column) returns the value of the column.
+        **/
+        template <typename Provider>
+        Node* lazyLeaf(Provider& feature);
+
+        /** @brief Recursively turns the subtrees visited less than minVisits times into leaves.**/
+        size_t pruneCold(Node* node, uint32_t minVisits);
+
+        /** @brief Recursively merges the subtree into the table of unique nodes.
+         * @param node The subtree to merge, the caller's reference is passed on to the returned node.
+         * @param table Open addressing hash table of the unique nodes.
+         * @param mask Table size minus one, the size is a power of two.
+         * @param unique Output variable, incremented for every node added to the table.
+         * @param freed Output variable, incremented by the number of bytes returned to the allocator.
+         * @return The node that replaces the subtree.
+        **/                
+        Node* compactNode(Node* node, Node** table, uint32_t mask, uint32_t* unique, size_t* freed);
+
+        /** @brief Counts the nodes of the subtree, shared nodes are counted once per parent.
+         * @param node The subtree root.
+        **/                
+        uint32_t countNodes(Node* node);
+
+        /** @brief Numbers the unique nodes in postorder, so the children always come before their parents.
+         * @param node The subtree root.
+         * @param table Open addressing hash table of the numbered nodes.
+         * @param numbers The numbers of the nodes in the table.
+         * @param mask Table size minus one, the size is a power of two.
+         * @param order Output variable, the nodes in the order of their numbers.
+         * @param count Output variable, number of numbered nodes.
+         * @return The number of the node.
+        **/
+        uint32_t numberNodes(Node* node, Node** table, uint32_t* numbers, uint32_t mask, Node** order, uint32_t* count);
+
+        /** @brief Finds the slot of a node in the table of numberNodes, or the empty slot where it would go.**/
+        uint32_t nodeSlot(Node* node, Node** table, uint32_t mask);
+
+        /** @brief Size of one node record of the model format.**/
+        size_t modelRecordSize(void);
+
+        /** @brief Routes the rows through the tree and prunes it in place.
+         * @param alpha Complexity cost of every extra leaf, relative to the error rate.
+         * @return Number of bytes returned to the allocator.
+        **/                
+        size_t prune(TFeature** X, TLabel** Y, uint32_t rows, float alpha);
+
+        /** @brief Xorshift32 random generator, restarted from randomSeed by every fit.
+         * @return Random number in range [0,n).
+        **/                
+        uint32_t random(uint32_t n);
+
+        /** @brief Converts maxFeatures to the number of features checked per node.
+         * @param cols Total number of features.
+        **/                
+        uint32_t featuresPerSplit(uint32_t cols);
 
         /** @brief The class constructor.
          * @param minSamplesSplit If the number of samples is less than this number the splitting process stops.
@@ -155,6 +513,23 @@ class TinyDecisionTreeClassifier{
         **/                
         TinyDecisionTreeClassifier(uint16_t maxDepth, uint16_t minSamplesSplit = 2);
 
+        /** @brief The class destructor, frees the tree, the free list and a fit in progress.**/                
+        ~TinyDecisionTreeClassifier();
+
+        /** @brief The tree is owned by one classifier, so it can be moved but not copied. The moved-from classifier is left untrained with a default allocator.**/                
+        TinyDecisionTreeClassifier(TinyDecisionTreeClassifier&& other);
+        TinyDecisionTreeClassifier& operator=(TinyDecisionTreeClassifier&& other);
+        TinyDecisionTreeClassifier(const TinyDecisionTreeClassifier&) = delete;
+        TinyDecisionTreeClassifier& operator=(const TinyDecisionTreeClassifier&) = delete;
+
+        /** @brief Takes the tree, the free list, the allocator and the hyperparameters of another classifier.**/                
+        void moveFrom(TinyDecisionTreeClassifier& other);
+
+        /** @brief Returns the nodes of the free list to the allocator.
+         * @return Number of bytes returned to the allocator.
+        **/                
+        size_t releaseFreeNodes(void);
+
         /** @brief Recursively plots the tree.
          * @param node Pointer to the root node.
          * @param depth Current depth.
@@ -166,23 +541,229 @@ class TinyDecisionTreeClassifier{
 
         /** @brief Fits the tree to input data.
          * @param X Input samples.
-         * @param Y Input classes.
+         * @param Y Input classes, Ycols columns per sample.
+         * @param rows Number or samples.
+         * @param Xcols Number of features.
+         * @param Ycols Number of outputs, every leaf predicts all of them and the splits minimize the sum of their entropies.
+         * @param weights Optional integer weight of every row, a row of weight w counts as w identical rows (also for minSamplesSplit). NULL gives every row weight 1.
+         * **/                
+        void fit(TFeature** X,TLabel** Y, uint32_t rows,uint32_t Xcols,uint16_t Ycols = 1,const uint32_t* weights = NULL);
+
+        /** @brief Fits the tree to sparse samples, time and memory scale with the nonzero values instead of rows*Xcols. Gives the same tree as fit() with the dense rows.
+         * Always uses the exact split search, subsampleThreshold, splitMode and collapseDuplicates are ignored.
+         * @param X Input samples in CSR format, kept until the fit is done.
+         * @param Y Input classes, Ycols columns per sample.
          * @param rows Number or samples.
+         * @param Xcols Number of features, the nonzero values of the other columns are ignored.
+         * @param Ycols Number of outputs.
+         * @param weights Optional integer weight of every row.
+         * **/                
+        void fit(const TinySparseRows<TFeature>& X,TLabel** Y, uint32_t rows,uint32_t Xcols,uint16_t Ycols = 1,const uint32_t* weights = NULL);
+
+        /** @brief Fits the tree to the rows of presorted lists, nothing is sorted. Used to fit many trees (e.g. cross-validation folds) to subsets of one dataset.
+         * Always uses the exact split search, subsampleThreshold and splitMode are ignored.
+         * @param X Input samples.
+         * @param Y Input classes, Ycols columns per sample.
+         * @param rows Number of samples in X and Y.
+         * @param sorted Xcols lists of n row indexes, list c is sorted by X[row][c]. The lists are reordered by the fit.
+         * @param n Number of rows to fit, the length of every list.
          * @param Xcols Number of features.
+         * @param Ycols Number of outputs.
+         * **/                
+        void fitPresorted(TFeature** X,TLabel** Y, uint32_t rows, uint32_t* sorted, uint32_t n, uint32_t Xcols,uint16_t Ycols = 1);
+
+        /** @brief Common part of beginFit and fitPresorted, encodes the classes and puts the root on the frontier.
+         * @param rsi The rows to fit.
+         * @return 0 or NOT_ENOUGH_MEMORY.
          * **/                
-        void fit(T** X,T** Y, uint32_t rows,uint32_t Xcols);
+        int16_t beginRows(TFeature** X,TLabel** Y, uint32_t rows, typename Node::RowsSubIndexes* rsi, uint32_t Xcols,uint16_t Ycols);
+
+        /** @brief Makes room for two more nodes on the frontier.**/                
+        bool reserveFrontier(void);
+
+        /** @brief Frees the row weights and indexes of the fit in progress.**/                
+        void endFit(void);
+
+        /** @brief Starts a fit that is carried out by step() calls, so that the training can be interleaved with other work (e.g. sampling a sensor) without a thread.
+         * The arguments are the same as for fit. X and Y must stay unchanged until isDone(). predict() can't be used until then.
+         * @return 0 or NOT_ENOUGH_MEMORY.
+         * **/                
+        int16_t beginFit(TFeature** X,TLabel** Y, uint32_t rows,uint32_t Xcols,uint16_t Ycols = 1,const uint32_t* weights = NULL);
+
+        /** @brief Expands at most maxNodes nodes of the fit started by beginFit. The cost of one node is about one pass of the split search over its rows.
+         * If a node can't get the memory for its decisions the fit stops and the tree stays untrained.
+         * @param maxNodes Maximum number of nodes to expand.
+         * @return Number of nodes expanded.
+         * **/                
+        uint32_t step(uint32_t maxNodes = 1);
+
+        /** @brief True when there is no fit in progress, the tree is trained (if the fit didn't run out of memory).**/                
+        bool isDone(void);
+
+        /** @brief Stops the fit in progress, the partially built tree is freed.**/                
+        void cancelFit(void);
+
+        /** @brief Walks the tree down to a leaf or to the given depth.
+         * @param X Input samples.
+         * @param depth The node at this depth is returned even if it is not a leaf (the root is at depth 1), 0 means no limit.
+         * **/                
+        Node* findNode(TFeature* X, uint16_t depth);
 
         /** @brief Classifies the input. The tree should be trained using fit method first. 
          * @param X Input samples.
+         * @return The class of the first output.
+         * **/                
+        TLabel predict(TFeature* X); 
+
+        /** @brief Classifies the input for every output. The tree should be trained using fit method first. 
+         * @param X Input samples.
+         * @param Y Output variable, outputs classes.
+         * **/                
+        void predict(TFeature* X, TLabel* Y); 
+
+        /** @brief Classifies the input without computing all the features up front. Only the features tested on the path to the leaf are requested, each at most once,
+         * so the cost of expensive features (variance, FFT bands...) scales with the path length instead of the number of features.
+         * @param feature Function or functor, feature(column) returns the value of the column as TFeature.
+         * @return The class of the first output.
+         * **/                
+        template <typename Provider>
+        typename TinyEnableIf<!TinyFeatureRow<Provider,TFeature>::isRow,TLabel>::type predict(Provider feature); 
+
+        /** @brief Classifies the input for every output, requesting only the features tested on the path to the leaf.
+         * @param feature Function or functor, feature(column) returns the value of the column as TFeature.
+         * @param Y Output variable, outputs classes.
+         * **/                
+        template <typename Provider>
+        typename TinyEnableIf<!TinyFeatureRow<Provider,TFeature>::isRow,void>::type predict(Provider feature, TLabel* Y); 
+
+        /** @brief Classifies a sparse sample, only the features on the path are looked up.
+         * @param X Input samples in CSR format.
+         * @param row The sample.
+         * @return The class of the first output.
+         * **/                
+        TLabel predict(const TinySparseRows<TFeature>& X, uint32_t row); 
+
+        /** @brief Classifies a sparse sample for every output.
+         * @param X Input samples in CSR format.
+         * @param row The sample.
+         * @param Y Output variable, outputs classes.
+         * **/                
+        void predict(const TinySparseRows<TFeature>& X, uint32_t row, TLabel* Y); 
+
+        /** @brief Minimal cost-complexity pruning, removes every split whose error reduction on the training data doesn't pay for alpha per extra leaf.
+         * Works in place, alpha=0 only removes the splits that don't reduce the training errors at all.
+         * @param X Training samples.
+         * @param Y Training classes.
+         * @param rows Number of samples.
+         * @param alpha Complexity parameter, the same as ccp_alpha of scikit-learn (with the misclassification rate as the impurity).
+         * @return Number of bytes returned to the allocator.
+         * **/                
+        size_t pruneCostComplexity(TFeature** X,TLabel** Y,uint32_t rows,float alpha);
+
+        /** @brief Reduced-error pruning, removes every split that doesn't make fewer errors on a held-out set than the majority decision of the node. Works in place.
+         * @param X Held-out samples.
+         * @param Y Held-out classes.
+         * @param rows Number of samples.
+         * @return Number of bytes returned to the allocator.
+         * **/                
+        size_t pruneReducedError(TFeature** X,TLabel** Y,uint32_t rows);
+
+        /** @brief Turns the tree into a decision DAG: structurally identical subtrees are stored once and splits whose both sides decide the same are removed.
+         * predict() works the same way on the result. Prune the tree before compacting, pruning a DAG uses only the rows of one of the paths to a shared node.
+         * @param nodesBefore Output variable (optional), number of nodes before compacting.
+         * @param nodesAfter Output variable (optional), number of nodes after compacting.
+         * @return Number of bytes returned to the allocator, 0 if there is not enough memory for the hash table.
+         * **/                
+        size_t compact(uint32_t* nodesBefore = NULL, uint32_t* nodesAfter = NULL);
+
+        /** @brief Writes the tree in a flat format that importModel reads (e.g. to flash a model trained on a PC). Shared nodes of a compacted tree are written once.
+         * The format is a 20-byte header (magic, sizeof(TFeature), 1 for floating point features, sizeof(TLabel), 0, outputs, 0, node count, columns)
+         * followed by one record per node in postorder (the root is the last one): column (DTR_MODEL_LEAF for leaves), the two children numbers, threshold, outputs decisions.
+         * All the values are in the native byte order of the machine.
+         * @param buffer Output buffer, NULL to get the size.
+         * @param size Size of the buffer.
+         * @return Number of bytes written (or needed if buffer is NULL), 0 if the buffer is too small or there is not enough memory.
+         * **/                
+        size_t exportModel(uint8_t* buffer, size_t size);
+
+        /** @brief Replaces the tree with a model written by exportModel, every node is allocated with the allocator.
+         * The current tree is kept when an error is returned.
+         * @param data The model.
+         * @param size Size of the model.
+         * @param cols Number of columns of the inputs predict() will get, a model that reads more columns is rejected. 0 trusts the columns of the model.
+         * @return 0, NOT_ENOUGH_MEMORY or INVALID_MODEL.
+         * **/                
+        int16_t importModel(const uint8_t* data, size_t size, uint32_t cols = 0);
+
+        /** @brief Checks a model written by exportModel without importing it: the header, the size, that the children come before their parents
+         * and that every split column is below the columns of the header. A model that passes can be walked in place.
+         * @param data The model.
+         * @param size Size of the model.
+         * @param cols Number of columns of the inputs, 0 trusts the columns of the model.
+         * @return 0 or INVALID_MODEL.
          * **/                
-        T predict(T* X); 
+        static int16_t validateModel(const uint8_t* data, size_t size, uint32_t cols = 0);
+
+        /** @brief Moves the nodes into one contiguous block (if they aren't yet) and starts counting the branches taken by predict() in branchCounts.
+         * Profiling makes predict() write to the classifier, so it must not be called from several threads at once.
+         * @return 0 or NOT_ENOUGH_MEMORY.
+         * **/                
+        int16_t beginProfile(void);
+
+        /** @brief Stops profiling and frees the counters.**/                
+        void endProfile(void);
 
-        /** @brief Checks the accuracy of trained tree. 
+        /** @brief Copies the nodes into one contiguous block in depth-first order, with the more frequently taken child (according to the profile, children[0] without one) right after its parent,
+         * so the hot path of predict() runs through neighbouring nodes. Shared nodes of a DAG are stored once. The profile is kept and follows the nodes.
+         * Needs memory for the new block while the old nodes are still allocated.
+         * @return 0 or NOT_ENOUGH_MEMORY.
+         * **/                
+        int16_t relayout(void);
+
+        /** @brief Turns every subtree that was reached less than minVisits times since beginProfile() into a leaf with its majority decision.
+         * The nodes stay in the block until the next relayout().
+         * @param minVisits 1 removes the subtrees that were never visited.
+         * @return Number of bytes returned to the allocator.
+         * **/                
+        size_t pruneColdNodes(uint32_t minVisits = 1);
+
+        /** @brief Checks the accuracy of trained tree, averaged over the outputs. 
          * @param X Input samples.
-         * @param Y Input features.
+         * @param Y Input classes.
+         * @param rows Number of samples
+         * **/                
+        float score(TFeature** X,TLabel** Y,uint32_t rows);
+
+        /** @brief Checks the accuracy of trained tree on sparse samples, averaged over the outputs. 
+         * @param X Input samples in CSR format.
+         * @param Y Input classes.
+         * @param rows Number of samples
+         * **/                
+        float score(const TinySparseRows<TFeature>& X,TLabel** Y,uint32_t rows);
+
+        /** @brief Average cost of the features a prediction computes, every feature on the path counted once as the lazy predict() does.
+         * Pass the training data to get the expected cost under the training distribution.
+         * @param X Input samples.
+         * @param rows Number of samples
+         * @return The sum of featureCosts per prediction, or the number of features per prediction if featureCosts is NULL.
+         * **/                
+        float expectedFeatureCost(TFeature** X,uint32_t rows);
+
+        /** @brief Checks the accuracy the tree would have if it was trained with a smaller maxDepth, every inner node keeps its majority class. 
+         * @param X Input samples.
+         * @param Y Input classes.
+         * @param rows Number of samples
+         * @param depth The tree is cut at this depth.
+         * **/                
+        float score(TFeature** X,TLabel** Y,uint32_t rows,uint16_t depth);
+
+        /** @brief Number of correct (sample, output) predictions of the tree cut at a depth, the exact count behind score().
+         * @param X Input samples.
+         * @param Y Input classes.
          * @param rows Number of samples
+         * @param depth The tree is cut at this depth.
          * **/                
-        float score(T** X,T** Y,uint32_t rows);
+        uint32_t countMatches(TFeature** X,TLabel** Y,uint32_t rows,uint16_t depth);
 };
 
 #include "TinyDecisionTreeClassifier.cpp"
@@ -0,0 +1,381 @@
+/* TinyDecisionTreeClassifier library
+ * Copyright (c) 2023-2024 Aleksei Karavaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Delta updates of exported models. diff() runs on the PC (it allocates), patch() runs on the device in the model buffer
+ * without any memory of its own. Not included by TinyDecisionTreeClassifier.h.
+ */
+
+#ifndef DECISION_TREE_DELTA_H
+#define DECISION_TREE_DELTA_H
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "TinyDecisionTreeClassifier.h"
+
+#define BASE_MODEL_MISMATCH                             -7
+
+/** @brief Delta format.**/
+#define DTR_DELTA_MAGIC                                 0x4C445444
+#define DTR_DELTA_HEADER_SIZE                           (24+DTR_MODEL_HEADER_SIZE)
+#define DTR_DELTA_COPY                                  1
+#define DTR_DELTA_LITERAL                               2
+/** @brief Shorter matches are sent as literals, a copy costs more than one record.**/
+#define DTR_DELTA_MIN_COPY                              2
+
+/** @brief Delta encoding of a model against the model the device already has, both in the exportModel format.
+ * A retrained tree usually keeps most of its subtrees, but they move to other record numbers and their child numbers change with them.
+ * diff() finds the subtrees of the target that are in the base too (by a structural hash, then record by record), a subtree is a range of records
+ * in postorder that only moved, so it is sent as a copy that shifts its child numbers. Everything else is sent as literal records.
+ * The delta is: a header (magic, base size, base hash, target size, target hash, number of operations, the target model header)
+ * and the operations, COPY (type, destination record, source record, count) or LITERAL (type, destination record, count, records).
+ * The operations are ordered so that none reads a record of the base another one has already overwritten, patch() needs no extra RAM.
+ * All the values are in the native byte order like the model.
+ **/
+class TinyModelDelta{
+    public:
+    /** @brief FNV-1a hash of a model, identifies the base model of a delta.
+     * @param model The model.
+     * @param size Size of the model.
+    **/
+    static uint32_t hash(const uint8_t* model, size_t size){
+        uint32_t h = 2166136261u;
+        for(size_t i=0;i<size;i++)h = (h^model[i])*16777619u;
+        return h;
+    }
+
+    /** @brief Encodes the target model as a delta against the base model.
+     * @param base The model on the device.
+     * @param baseSize Size of the base model.
+     * @param target The new model.
+     * @param targetSize Size of the new model.
+     * @param delta Output buffer, NULL to get the size.
+     * @param size Size of the buffer.
+     * @return Number of bytes written (or needed if delta is NULL), 0 if the buffer is too small, a model is invalid or there is not enough memory.
+    **/
+    static size_t diff(const uint8_t* base, size_t baseSize, const uint8_t* target, size_t targetSize, uint8_t* delta, size_t size){
+        uint32_t baseCount = 0;
+        uint32_t targetCount = 0;
+        size_t recordSize = modelRecordSize(target,targetSize,&targetCount);
+        size_t baseRecordSize = modelRecordSize(base,baseSize,&baseCount);
+        if(recordSize==0 || baseRecordSize==0)return 0;
+        //Copies only make sense between models with the same types and outputs
+        if(baseRecordSize!=recordSize)baseCount = 0;
+
+        Op* ops = (Op*)malloc((targetCount+1)*sizeof(Op));
+        uint32_t* baseTrees = (uint32_t*)malloc(2*(baseCount+1)*sizeof(uint32_t));
+        uint32_t* targetTrees = (uint32_t*)malloc(2*(targetCount+1)*sizeof(uint32_t));
+        uint32_t* copyFrom = (uint32_t*)malloc((targetCount+1)*sizeof(uint32_t));
+        uint32_t tableSize = 2;
+        while(tableSize<2*baseCount)tableSize<<=1;
+        uint32_t* table = (uint32_t*)malloc(tableSize*sizeof(uint32_t));
+        if(ops==NULL || baseTrees==NULL || targetTrees==NULL || copyFrom==NULL || table==NULL){
+            free(table);
+            free(copyFrom);
+            free(targetTrees);
+            free(baseTrees);
+            free(ops);
+            return 0;
+        }
+        const uint8_t* baseRecords = base+DTR_MODEL_HEADER_SIZE;
+        const uint8_t* targetRecords = target+DTR_MODEL_HEADER_SIZE;
+        hashSubtrees(baseRecords,baseCount,recordSize,baseTrees);
+        hashSubtrees(targetRecords,targetCount,recordSize,targetTrees);
+
+        //Base subtrees by their hash, the table keeps the record number of the root plus one
+        uint32_t mask = tableSize-1;
+        for(uint32_t i=0;i<tableSize;i++)table[i]=0;
+        for(uint32_t m=0;m<baseCount;m++){
+            uint32_t slot = baseTrees[2*m]&mask;
+            while(table[slot]!=0 && baseTrees[2*(table[slot]-1)]!=baseTrees[2*m])slot=(slot+1)&mask;
+            if(table[slot]==0)table[slot]=m+1;
+        }
+
+        //The largest unchanged subtrees first, from the root down. A subtree is a contiguous range of records in postorder,
+        //every record is still compared, so hash collisions and the shared nodes of a DAG only cost a literal
+        const uint32_t none = 0xFFFFFFFF;
+        for(uint32_t n=0;n<targetCount;n++)copyFrom[n]=none;
+        for(uint32_t n=targetCount;n>0;){
+            n--;
+            uint32_t trees = targetTrees[2*n+1];
+            uint32_t slot = targetTrees[2*n]&mask;
+            while(table[slot]!=0 && baseTrees[2*(table[slot]-1)]!=targetTrees[2*n])slot=(slot+1)&mask;
+            if(table[slot]==0 || trees>n+1)continue;
+            uint32_t m = table[slot]-1;
+            if(baseTrees[2*m+1]!=trees || trees>m+1)continue;
+            uint32_t k = 0;
+            while(k<trees && sameRelative(baseRecords,m+1-trees+k,targetRecords,n+1-trees+k,recordSize))k++;
+            if(k<trees)continue;
+            for(k=0;k<trees;k++)copyFrom[n+1-trees+k] = m+1-trees+k;
+            n = n+1-trees;
+        }
+        free(table);
+        free(targetTrees);
+        free(baseTrees);
+
+        //Neighbouring copied subtrees with the same shift become one copy, short copies and the rest literals
+        uint32_t opsCount = 0;
+        uint32_t literalStart = 0;
+        for(uint32_t n=0;n<targetCount;){
+            uint32_t run = 0;
+            while(n+run<targetCount && copyFrom[n+run]!=none && copyFrom[n+run]==copyFrom[n]+run)run++;
+            if(run<DTR_DELTA_MIN_COPY){
+                n++;
+                continue;
+            }
+            if(literalStart<n)ops[opsCount++] = Op(DTR_DELTA_LITERAL,literalStart,0,n-literalStart);
+            ops[opsCount++] = Op(DTR_DELTA_COPY,n,copyFrom[n],run);
+            n += run;
+            literalStart = n;
+        }
+        if(literalStart<targetCount)ops[opsCount++] = Op(DTR_DELTA_LITERAL,literalStart,0,targetCount-literalStart);
+        free(copyFrom);
+
+        if(!orderCopies(ops,opsCount)){
+            free(ops);
+            return 0;
+        }
+
+        size_t written = DTR_DELTA_HEADER_SIZE;
+        for(uint32_t i=0;i<opsCount;i++){
+            written += ops[i].type==DTR_DELTA_COPY ? 1+3*sizeof(uint32_t) : 1+2*sizeof(uint32_t)+ops[i].count*recordSize;
+        }
+        if(delta!=NULL){
+            if(size<written){
+                free(ops);
+                return 0;
+            }
+            uint32_t header[6] = {DTR_DELTA_MAGIC,(uint32_t)baseSize,hash(base,baseSize),(uint32_t)targetSize,hash(target,targetSize),opsCount};
+            memcpy(delta,header,sizeof(header));
+            memcpy(delta+sizeof(header),target,DTR_MODEL_HEADER_SIZE);
+            uint8_t* p = delta+DTR_DELTA_HEADER_SIZE;
+            for(uint32_t i=0;i<opsCount;i++){
+                *p++ = ops[i].type;
+                if(ops[i].type==DTR_DELTA_COPY){
+                    uint32_t fields[3] = {ops[i].destination,ops[i].source,ops[i].count};
+                    memcpy(p,fields,sizeof(fields));
+                    p += sizeof(fields);
+                }else{
+                    uint32_t fields[2] = {ops[i].destination,ops[i].count};
+                    memcpy(p,fields,sizeof(fields));
+                    p += sizeof(fields);
+                    memcpy(p,targetRecords+(size_t)ops[i].destination*recordSize,ops[i].count*recordSize);
+                    p += ops[i].count*recordSize;
+                }
+            }
+        }
+        free(ops);
+        return written;
+    }
+
+    /** @brief Turns the base model into the target model in place.
+     * @param model Buffer with the base model, it gets the target model. The base is checked by its size and hash.
+     * @param modelSize Size of the base model, set to the size of the target model.
+     * @param capacity Size of the buffer, at least the size of the target model.
+     * @param delta The delta written by diff.
+     * @param deltaSize Size of the delta.
+     * @return 0, BASE_MODEL_MISMATCH (the buffer is untouched), NOT_ENOUGH_MEMORY (the buffer is too small, untouched) or INVALID_MODEL (broken delta, the buffer may be broken too).
+    **/
+    static int16_t patch(uint8_t* model, size_t* modelSize, size_t capacity, const uint8_t* delta, size_t deltaSize){
+        if(deltaSize<DTR_DELTA_HEADER_SIZE)return INVALID_MODEL;
+        uint32_t header[6];
+        memcpy(header,delta,sizeof(header));
+        if(header[0]!=DTR_DELTA_MAGIC)return INVALID_MODEL;
+        if(header[1]!=*modelSize || header[2]!=hash(model,*modelSize))return BASE_MODEL_MISMATCH;
+        if(header[3]>capacity)return NOT_ENOUGH_MEMORY;
+        uint32_t count;
+        size_t recordSize = modelRecordSize(delta+sizeof(header),header[3],&count);
+        if(recordSize==0)return INVALID_MODEL;
+        uint32_t baseCount = (uint32_t)((*modelSize-DTR_MODEL_HEADER_SIZE)/recordSize);
+
+        uint8_t* records = model+DTR_MODEL_HEADER_SIZE;
+        const uint8_t* p = delta+DTR_DELTA_HEADER_SIZE;
+        const uint8_t* end = delta+deltaSize;
+        for(uint32_t i=0;i<header[5];i++){
+            if(p>=end)return INVALID_MODEL;
+            uint8_t type = *p++;
+            if(type==DTR_DELTA_COPY){
+                uint32_t fields[3];
+                if((size_t)(end-p)<sizeof(fields))return INVALID_MODEL;
+                memcpy(fields,p,sizeof(fields));
+                p += sizeof(fields);
+                if(fields[0]>count || fields[2]>count-fields[0] || fields[1]>baseCount || fields[2]>baseCount-fields[1])return INVALID_MODEL;
+                copyRecords(records,fields[0],fields[1],fields[2],recordSize);
+            }else if(type==DTR_DELTA_LITERAL){
+                uint32_t fields[2];
+                if((size_t)(end-p)<sizeof(fields))return INVALID_MODEL;
+                memcpy(fields,p,sizeof(fields));
+                p += sizeof(fields);
+                if(fields[0]>count || fields[1]>count-fields[0] || (size_t)(end-p)<fields[1]*recordSize)return INVALID_MODEL;
+                memcpy(records+(size_t)fields[0]*recordSize,p,fields[1]*recordSize);
+                p += fields[1]*recordSize;
+            }else{
+                return INVALID_MODEL;
+            }
+        }
+        //The copies never read the header, it is replaced last
+        memcpy(model,delta+sizeof(header),DTR_MODEL_HEADER_SIZE);
+        *modelSize = header[3];
+        if(hash(model,*modelSize)!=header[4])return INVALID_MODEL;
+        return 0;
+    }
+
+    private:
+    struct Op{
+        uint8_t type;
+        uint32_t destination;
+        uint32_t source;
+        uint32_t count;
+        Op(){}
+        Op(uint8_t type, uint32_t destination, uint32_t source, uint32_t count) : type(type), destination(destination), source(source), count(count){}
+    };
+
+    /** @brief Record size of a model after checking its header, 0 if it is invalid.**/
+    static size_t modelRecordSize(const uint8_t* model, size_t size, uint32_t* count){
+        if(size<DTR_MODEL_HEADER_SIZE)return 0;
+        uint32_t magic;
+        uint16_t outputs;
+        memcpy(&magic,model,4);
+        memcpy(&outputs,model+8,2);
+        memcpy(count,model+12,4);
+        size_t recordSize = 3*sizeof(uint32_t)+model[4]+outputs*model[6];
+        if(magic!=DTR_MODEL_MAGIC || outputs==0 || (size-DTR_MODEL_HEADER_SIZE)/recordSize<*count)return 0;
+        return recordSize;
+    }
+
+    /** @brief Hash and number of records of every subtree, trees[2*n] and trees[2*n+1] are for the subtree of record n.
+     * The children come before their parents, so one pass is enough. A broken child number makes the record its own subtree.
+    **/
+    static void hashSubtrees(const uint8_t* records, uint32_t count, size_t recordSize, uint32_t* trees){
+        for(uint32_t n=0;n<count;n++){
+            const uint8_t* record = records+(size_t)n*recordSize;
+            uint32_t fields[3];
+            memcpy(fields,record,sizeof(fields));
+            uint32_t size = 1;
+            if(fields[0]!=DTR_MODEL_LEAF && fields[1]<n && fields[2]<n){
+                size += trees[2*fields[1]+1]+trees[2*fields[2]+1];
+                fields[1] = trees[2*fields[1]];
+                fields[2] = trees[2*fields[2]];
+            }
+            uint32_t h = hash((const uint8_t*)fields,sizeof(fields));
+            for(size_t i=sizeof(fields);i<recordSize;i++)h = (h^record[i])*16777619u;
+            trees[2*n] = h;
+            trees[2*n+1] = size;
+        }
+    }
+
+    /** @brief True if record m of a and record n of b are the same after shifting a by n-m.**/
+    static bool sameRelative(const uint8_t* a, uint32_t m, const uint8_t* b, uint32_t n, size_t recordSize){
+        const uint8_t* ra = a+(size_t)m*recordSize;
+        const uint8_t* rb = b+(size_t)n*recordSize;
+        uint32_t fa[3];
+        uint32_t fb[3];
+        memcpy(fa,ra,sizeof(fa));
+        memcpy(fb,rb,sizeof(fb));
+        if(fa[0]!=fb[0])return false;
+        if(fa[0]!=DTR_MODEL_LEAF){
+            //A child before the start of the model can't be shifted there
+            if(fa[1]>m || fa[2]>m || m-fa[1]!=n-fb[1] || m-fa[2]!=n-fb[2])return false;
+        }
+        return memcmp(ra+sizeof(fa),rb+sizeof(fb),recordSize-sizeof(fa))==0;
+    }
+
+    /** @brief Copies count records from source to destination shifting their children, overlapping ranges are copied in the safe direction.**/
+    static void copyRecords(uint8_t* records, uint32_t destination, uint32_t source, uint32_t count, size_t recordSize){
+        for(uint32_t k=0;k<count;k++){
+            uint32_t i = destination>source ? count-1-k : k;
+            uint8_t* to = records+(size_t)(destination+i)*recordSize;
+            memmove(to,records+(size_t)(source+i)*recordSize,recordSize);
+            uint32_t fields[3];
+            memcpy(fields,to,sizeof(fields));
+            if(fields[0]!=DTR_MODEL_LEAF){
+                fields[1] += destination-source;
+                fields[2] += destination-source;
+                memcpy(to,fields,sizeof(fields));
+            }
+        }
+    }
+
+    static bool overlaps(uint32_t a, uint32_t aCount, uint32_t b, uint32_t bCount){
+        return a<b+bCount && b<a+aCount;
+    }
+
+    /** @brief Orders the copies so that no copy reads base records another copy has already written (Burns-Long).
+     * A copy that is part of a cycle becomes a literal, the literals read nothing from the base and go last.
+    **/
+    static bool orderCopies(Op* ops, uint32_t opsCount){
+        //pending[i] is the number of copies that must run before copy i: the ones reading what i writes
+        uint32_t* pending = (uint32_t*)malloc((opsCount+1)*sizeof(uint32_t));
+        Op* ordered = (Op*)malloc((opsCount+1)*sizeof(Op));
+        bool* done = (bool*)malloc((opsCount+1)*sizeof(bool));
+        if(pending==NULL || ordered==NULL || done==NULL){
+            free(done);
+            free(ordered);
+            free(pending);
+            return false;
+        }
+        for(uint32_t i=0;i<opsCount;i++){
+            done[i] = ops[i].type!=DTR_DELTA_COPY;
+            pending[i] = 0;
+        }
+        for(uint32_t i=0;i<opsCount;i++){
+            if(done[i])continue;
+            for(uint32_t j=0;j<opsCount;j++){
+                if(j!=i && !done[j] && overlaps(ops[j].source,ops[j].count,ops[i].destination,ops[i].count))pending[i]++;
+            }
+        }
+        uint32_t orderedCount = 0;
+        uint32_t left = 0;
+        for(uint32_t i=0;i<opsCount;i++)if(!done[i])left++;
+        while(left>0){
+            bool progress = false;
+            for(uint32_t i=0;i<opsCount;i++){
+                if(done[i] || pending[i]!=0)continue;
+                ordered[orderedCount++] = ops[i];
+                release(ops,opsCount,done,pending,i);
+                left--;
+                progress = true;
+            }
+            if(progress)continue;
+            //Every remaining copy waits for another one, the longest wait is broken by sending its records
+            uint32_t victim = opsCount;
+            for(uint32_t i=0;i<opsCount;i++){
+                if(!done[i] && (victim==opsCount || pending[i]>pending[victim]))victim = i;
+            }
+            ops[victim].type = DTR_DELTA_LITERAL;
+            release(ops,opsCount,done,pending,victim);
+            left--;
+        }
+        for(uint32_t i=0;i<opsCount;i++){
+            if(ops[i].type==DTR_DELTA_LITERAL)ordered[orderedCount++] = ops[i];
+        }
+        memcpy(ops,ordered,opsCount*sizeof(Op));
+        free(done);
+        free(ordered);
+        free(pending);
+        return true;
+    }
+
+    /** @brief Marks copy i as done (applied or turned into a literal), the copies writing what it reads wait for one copy less.**/
+    static void release(Op* ops, uint32_t opsCount, bool* done, uint32_t* pending, uint32_t i){
+        done[i] = true;
+        for(uint32_t j=0;j<opsCount;j++){
+            if(!done[j] && overlaps(ops[i].source,ops[i].count,ops[j].destination,ops[j].count))pending[j]--;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,127 @@
+/* TinyDecisionTreeClassifier library
+ * Copyright (c) 2023-2024 Aleksei Karavaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DECISION_TREE_FEATURES_H
+#define DECISION_TREE_FEATURES_H
+#include <stdint.h>
+
+/** @brief Features per channel: mean, average difference between the neighbouring samples and variance.**/
+#define DTR_WINDOW_FEATURES             3
+
+/** @brief Streaming window features (mean, avgDif, variance of every channel), the same ones the examples computed from the sample buffers.
+ * Every sample is folded into the running statistics of the current hop with Welford's update, a finished hop is kept as (mean, M2, first, last)
+ * and a window is the merge of its last Window/Hop hops. So a window costs O(Window/Hop) instead of two passes over Window samples,
+ * and the memory is Window/Hop hop summaries per channel instead of Window samples.
+ * @param Channels Number of the input channels, e.g. 3 for the accelerometer axes.
+ * @param Window Window length in samples.
+ * @param Hop A new feature vector every Hop samples, Window must be divisible by it. Hop = Window gives non-overlapping windows.
+ * @param TFeature Type of the classifier features.
+ **/
+template <uint16_t Channels, uint16_t Window, uint16_t Hop = Window, typename TFeature = float>
+class TinyWindowFeatures{
+    static_assert(Window>=2 && Hop>=1 && Window%Hop==0, "Window must be at least 2 and divisible by Hop");
+
+    public:
+    /** @brief Length of the feature vector, channel c goes to X[c*DTR_WINDOW_FEATURES..c*DTR_WINDOW_FEATURES+2].**/
+    static const uint16_t features = Channels*DTR_WINDOW_FEATURES;
+
+    TinyWindowFeatures(){
+        reset();
+    }
+
+    /** @brief Forgets all the samples, the next vector comes after a full window.**/
+    void reset(void){
+        count=0;
+        hops=0;
+        slot=0;
+    }
+
+    /** @brief Adds one sample of every channel.
+     * @param sample Channels values.
+     * @param X Output variable, features values in the classifier input layout, written when a window ends.
+     * @return True if X holds the features of a new window.
+    **/
+    bool push(const float* sample, TFeature* X){
+        count++;
+        for(uint16_t c=0;c<Channels;c++){
+            Summary& s = current[c];
+            float x = sample[c];
+            if(count==1){
+                s.mean=x;
+                s.m2=0;
+                s.first=x;
+            }else{
+                float delta = x-s.mean;
+                s.mean += delta/count;
+                s.m2 += delta*(x-s.mean);
+            }
+            s.last=x;
+        }
+        if(count<Hop)return false;
+
+        for(uint16_t c=0;c<Channels;c++){
+            history[slot][c]=current[c];
+        }
+        slot = slot+1==HOPS ? 0 : slot+1;
+        count=0;
+        if(hops<HOPS)hops++;
+        if(hops<HOPS)return false;
+        write(X);
+        return true;
+    }
+
+    private:
+    /** @brief Number of the hops in a window.**/
+    static const uint16_t HOPS = Window/Hop;
+
+    struct Summary{
+        float mean;
+        float m2;
+        float first;
+        float last;
+    };
+    Summary current[Channels];
+    /** @brief The last HOPS finished hops, slot is the oldest one.**/
+    Summary history[HOPS][Channels];
+    uint16_t count;
+    uint16_t hops;
+    uint16_t slot;
+
+    /** @brief Merges the hops of the window (Chan's parallel variance) and writes the features.**/
+    void write(TFeature* X){
+        for(uint16_t c=0;c<Channels;c++){
+            const Summary& oldest = history[slot][c];
+            float mean = oldest.mean;
+            float m2 = oldest.m2;
+            float n = Hop;
+            for(uint16_t h=1;h<HOPS;h++){
+                const Summary& s = history[(slot+h)%HOPS][c];
+                float delta = s.mean-mean;
+                float merged = n+Hop;
+                mean += delta*Hop/merged;
+                m2 += s.m2+delta*delta*n*Hop/merged;
+                n = merged;
+            }
+            const Summary& newest = history[(slot+HOPS-1)%HOPS][c];
+            //The differences of the neighbouring samples telescope to last-first
+            X[c*DTR_WINDOW_FEATURES] = (TFeature)mean;
+            X[c*DTR_WINDOW_FEATURES+1] = (TFeature)((newest.last-oldest.first)/(Window-1));
+            X[c*DTR_WINDOW_FEATURES+2] = (TFeature)(m2/(Window-1));
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,511 @@
+/* TinyDecisionTreeClassifier library
+ * Copyright (c) 2023-2024 Aleksei Karavaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Many models in one memory-mapped file. Needs POSIX mmap, so it is for the PC/server side only,
+ * it is not included by TinyDecisionTreeClassifier.h.
+ */
+
+#ifndef DECISION_TREE_MODEL_STORE_H
+#define DECISION_TREE_MODEL_STORE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "TinyDecisionTreeClassifier.h"
+
+#define STORE_IO_ERROR                                  -6
+
+/** @brief Store file format.**/
+#define DTR_STORE_MAGIC                                 0x534D5444
+#define DTR_STORE_VERSION                               2
+#define DTR_STORE_HEADER_SIZE                           64
+/** @brief Index slots of a new store, the index doubles when it is half full.**/
+#define DTR_STORE_INITIAL_SLOTS                         64
+/** @brief Offsets of the empty and the removed index slots, the header is there so no model can start at them.**/
+#define DTR_STORE_EMPTY                                 0
+#define DTR_STORE_REMOVED                               1
+/** @brief Rows the batched predict() walks down the tree together.**/
+#define DTR_STORE_BATCH                                 32
+
+/** @brief Thousands of models (e.g. one per device) in one file, opened with a single mmap and used in place.
+ * The file is a 64-byte header, the models in the exportModel format one after another and an open addressing index of (id, offset, size) slots.
+ * Adding or replacing a model appends it and rewrites its index slot, the replaced bytes stay in the file as garbage (garbageBytes).
+ * When the index gets half full a twice larger one is appended and the header is switched to it, so the models are never moved.
+ * predict() walks the mapped records directly, nothing is imported or allocated, so open() checks every model once.
+ * A model is appended and flushed before the header covers it and only then its slot points to it, a slot a crash left broken is dropped by open().
+ * Any number of threads may predict at the same time, but not while put() or remove() run: they can remap the file.
+ **/
+template <typename TFeature, typename TLabel = uint8_t>
+class TinyModelStore{
+    public:
+    TinyModelStore(){}
+
+    ~TinyModelStore(){
+        close();
+    }
+
+    TinyModelStore(const TinyModelStore&) = delete;
+    TinyModelStore& operator=(const TinyModelStore&) = delete;
+
+    /** @brief Maps the store, an empty or missing file becomes a new store if writable.
+     * Slots pointing outside the used bytes or to a model that doesn't pass the checks of importModel are dropped (see damagedModels),
+     * in the file if writable, else only in this mapping.
+     * @param path The file.
+     * @param writable False maps it read only, put() and remove() fail then.
+     * @return 0, STORE_IO_ERROR or INVALID_MODEL (not a store of these feature and label types).
+    **/
+    int16_t open(const char* path, bool writable = true){
+        close();
+        fd = ::open(path,writable ? O_RDWR|O_CREAT : O_RDONLY,0644);
+        if(fd<0)return STORE_IO_ERROR;
+        this->writable = writable;
+        struct stat st;
+        if(fstat(fd,&st)!=0){
+            close();
+            return STORE_IO_ERROR;
+        }
+        if(st.st_size==0){
+            if(!writable){
+                close();
+                return INVALID_MODEL;
+            }
+            int16_t rslt = create();
+            if(rslt!=0)close();
+            return rslt;
+        }
+        if((size_t)st.st_size<DTR_STORE_HEADER_SIZE || !map(st.st_size)){
+            close();
+            return st.st_size<DTR_STORE_HEADER_SIZE ? INVALID_MODEL : STORE_IO_ERROR;
+        }
+        Header* h = header();
+        if(h->magic!=DTR_STORE_MAGIC || h->version!=DTR_STORE_VERSION || h->featureSize!=sizeof(TFeature) || h->labelSize!=sizeof(TLabel)
+            || h->end>mappedSize || h->slots==0 || (h->slots&(h->slots-1))!=0 || h->slots>h->end/sizeof(Slot)
+            || h->indexOffset<DTR_STORE_HEADER_SIZE || h->indexOffset>h->end-h->slots*sizeof(Slot)){
+            close();
+            return INVALID_MODEL;
+        }
+        //find() and predict() trust the slots and the records, a broken one is treated as never committed
+        Slot* slots = index();
+        for(uint64_t i=0;i<h->slots;i++){
+            if(slots[i].offset==DTR_STORE_EMPTY || slots[i].offset==DTR_STORE_REMOVED)continue;
+            if(slots[i].offset>=DTR_STORE_HEADER_SIZE && slots[i].offset<=h->end && slots[i].size<=h->end-slots[i].offset
+                && valid(mapped+slots[i].offset,slots[i].size))continue;
+            slots[i].offset = DTR_STORE_REMOVED;
+            slots[i].size = 0;
+            if(h->models>0)h->models--;
+            damaged++;
+        }
+        return 0;
+    }
+
+    /** @brief Number of the broken slots open() dropped.**/
+    uint64_t damagedModels(void){
+        return damaged;
+    }
+
+    /** @brief Writes the mapped pages back and unmaps the file.**/
+    void close(void){
+        if(mapped!=NULL){
+            uint64_t end = header()->end;
+            if(writable)msync(mapped,mappedSize,MS_SYNC);
+            munmap(mapped,mappedSize);
+            //The file was grown in steps, the unused tail is cut off
+            if(writable && end<mappedSize && ftruncate(fd,end)!=0){}
+        }
+        if(fd>=0)::close(fd);
+        mapped=NULL;
+        mappedSize=0;
+        fd=-1;
+        damaged=0;
+    }
+
+    /** @brief Number of the models in the store.**/
+    uint64_t size(void){
+        return mapped ? header()->models : 0;
+    }
+
+    /** @brief Bytes of the replaced and removed models and of the old indexes.**/
+    uint64_t garbageBytes(void){
+        return mapped ? header()->garbage : 0;
+    }
+
+    /** @brief Finds a model in O(1).
+     * @param id The model id.
+     * @param size Output variable (optional), size of the model.
+     * @return The model in the exportModel format (importModel can read it), NULL if there is no such model. Valid until the next put() or remove().
+    **/
+    const uint8_t* find(uint64_t id, size_t* size = NULL){
+        Slot* slot = lookup(id);
+        if(slot==NULL)return NULL;
+        if(size)*size = slot->size;
+        return mapped+slot->offset;
+    }
+
+    /** @brief Adds or replaces a model.
+     * @param id The model id.
+     * @param clf Trained classifier, its exportModel is stored.
+     * @return 0, NOT_ENOUGH_MEMORY, INVALID_MODEL (not trained) or STORE_IO_ERROR.
+    **/
+    template <typename Allocator>
+    int16_t put(uint64_t id, TinyDecisionTreeClassifier<TFeature,TLabel,Allocator>& clf){
+        size_t size = clf.exportModel(NULL,0);
+        if(size==0)return clf.trained ? NOT_ENOUGH_MEMORY : INVALID_MODEL;
+        uint64_t offset;
+        int16_t rslt = reserve(size,&offset);
+        if(rslt!=0)return rslt;
+        if(clf.exportModel(mapped+offset,size)!=size)return NOT_ENOUGH_MEMORY;
+        return commit(id,offset,size);
+    }
+
+    /** @brief Adds or replaces a model written by exportModel.
+     * @param id The model id.
+     * @param model The model.
+     * @param size Size of the model.
+     * @return 0, INVALID_MODEL or STORE_IO_ERROR.
+    **/
+    int16_t put(uint64_t id, const uint8_t* model, size_t size){
+        if(!valid(model,size))return INVALID_MODEL;
+        uint64_t offset;
+        int16_t rslt = reserve(size,&offset);
+        if(rslt!=0)return rslt;
+        memcpy(mapped+offset,model,size);
+        return commit(id,offset,size);
+    }
+
+    /** @brief Removes a model, its bytes become garbage.
+     * @param id The model id.
+     * @return False if there is no such model or the store is read only.
+    **/
+    bool remove(uint64_t id){
+        if(!writable)return false;
+        Slot* slot = lookup(id);
+        if(slot==NULL)return false;
+        Header* h = header();
+        h->garbage += slot->size;
+        slot->offset = DTR_STORE_REMOVED;
+        slot->size = 0;
+        h->models--;
+        return true;
+    }
+
+    /** @brief Classifies the input with a model of the store, straight from the mapped file.
+     * @param id The model id.
+     * @param X Input sample.
+     * @return The class of the first output, 0 if there is no such model.
+    **/
+    TLabel predict(uint64_t id, const TFeature* X){
+        size_t size;
+        const uint8_t* model = find(id,&size);
+        if(model==NULL)return 0;
+        const uint8_t* leaf = leafRecord(model,X);
+        if(leaf==NULL)return 0;
+        TLabel y;
+        memcpy(&y,leaf+3*sizeof(uint32_t)+sizeof(TFeature),sizeof(TLabel));
+        return y;
+    }
+
+    /** @brief Classifies the input for every output with a model of the store.
+     * @param id The model id.
+     * @param X Input sample.
+     * @param Y Output variable, outputs classes (the outputs of the model).
+     * @return False if there is no such model, Y is not written then.
+    **/
+    bool predict(uint64_t id, const TFeature* X, TLabel* Y){
+        const uint8_t* model = find(id);
+        if(model==NULL)return false;
+        uint16_t outputs;
+        memcpy(&outputs,model+8,2);
+        const uint8_t* leaf = leafRecord(model,X);
+        if(leaf==NULL)return false;
+        memcpy(Y,leaf+3*sizeof(uint32_t)+sizeof(TFeature),outputs*sizeof(TLabel));
+        return true;
+    }
+
+    /** @brief Classifies a batch of inputs with one model. The rows go down the tree one level at a time in groups of DTR_STORE_BATCH,
+     * so the loads of independent rows overlap instead of waiting for each other.
+     * @param id The model id.
+     * @param X Input samples.
+     * @param rows Number of samples.
+     * @param Y Output variable, rows*outputs classes, the outputs of row r start at Y[r*outputs].
+     * @return False if there is no such model, Y is not written then.
+    **/
+    bool predict(uint64_t id, const TFeature* const* X, uint32_t rows, TLabel* Y){
+        const uint8_t* model = find(id);
+        if(model==NULL)return false;
+        uint16_t outputs;
+        uint32_t count;
+        memcpy(&outputs,model+8,2);
+        memcpy(&count,model+12,4);
+        size_t recordSize = 3*sizeof(uint32_t)+sizeof(TFeature)+outputs*sizeof(TLabel);
+        const uint8_t* records = model+DTR_MODEL_HEADER_SIZE;
+        uint32_t node[DTR_STORE_BATCH];
+        uint32_t active[DTR_STORE_BATCH];
+        for(uint32_t first=0;first<rows;first+=DTR_STORE_BATCH){
+            uint32_t n = rows-first<DTR_STORE_BATCH ? rows-first : DTR_STORE_BATCH;
+            for(uint32_t r=0;r<n;r++){
+                node[r] = count-1;
+                active[r] = r;
+            }
+            while(n>0){
+                uint32_t left = 0;
+                for(uint32_t k=0;k<n;k++){
+                    uint32_t r = active[k];
+                    const uint8_t* record = records+(size_t)node[r]*recordSize;
+                    uint32_t fields[3];
+                    memcpy(fields,record,sizeof(fields));
+                    TLabel* y = Y+(size_t)(first+r)*outputs;
+                    if(fields[0]==DTR_MODEL_LEAF){
+                        memcpy(y,record+sizeof(fields)+sizeof(TFeature),outputs*sizeof(TLabel));
+                        continue;
+                    }
+                    TFeature th;
+                    memcpy(&th,record+sizeof(fields),sizeof(TFeature));
+                    uint32_t next = X[first+r][fields[0]]<=th ? fields[1] : fields[2];
+                    if(next>=node[r]){
+                        memset(y,0,outputs*sizeof(TLabel));
+                        continue;
+                    }
+                    node[r] = next;
+                    active[left++] = r;
+                }
+                n = left;
+            }
+        }
+        return true;
+    }
+
+    /** @brief Number of outputs of a model.
+     * @param id The model id.
+     * @return 0 if there is no such model.
+    **/
+    uint16_t outputs(uint64_t id){
+        const uint8_t* model = find(id);
+        if(model==NULL)return 0;
+        uint16_t outputs;
+        memcpy(&outputs,model+8,2);
+        return outputs;
+    }
+
+    /** @brief Number of features a model reads (its largest split column plus one), scans all the records of the model.
+     * @param id The model id.
+     * @return 0 if there is no such model or it is a single leaf.
+    **/
+    uint32_t features(uint64_t id){
+        const uint8_t* model = find(id);
+        if(model==NULL)return 0;
+        uint16_t outputs;
+        uint32_t count;
+        memcpy(&outputs,model+8,2);
+        memcpy(&count,model+12,4);
+        size_t recordSize = 3*sizeof(uint32_t)+sizeof(TFeature)+outputs*sizeof(TLabel);
+        uint32_t features = 0;
+        for(uint32_t n=0;n<count;n++){
+            uint32_t column;
+            memcpy(&column,model+DTR_MODEL_HEADER_SIZE+(size_t)n*recordSize,sizeof(column));
+            if(column!=DTR_MODEL_LEAF && column+1>features)features = column+1;
+        }
+        return features;
+    }
+
+    private:
+    struct Header{
+        uint32_t magic;
+        uint16_t version;
+        uint8_t featureSize;
+        uint8_t labelSize;
+        /** @brief Used bytes of the file, the file itself is grown in larger steps.**/
+        uint64_t end;
+        uint64_t indexOffset;
+        uint64_t slots;
+        /** @brief Slots that are not empty (models and removed ones), the index grows when it is half of slots.**/
+        uint64_t usedSlots;
+        uint64_t models;
+        uint64_t garbage;
+        uint64_t reserved;
+    };
+    struct Slot{
+        uint64_t id;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    int fd=-1;
+    bool writable=false;
+    uint8_t* mapped=NULL;
+    size_t mappedSize=0;
+    uint64_t damaged=0;
+
+    Header* header(void){
+        return (Header*)mapped;
+    }
+
+    Slot* index(void){
+        return (Slot*)(mapped+header()->indexOffset);
+    }
+
+    static uint64_t hash(uint64_t id){
+        //Fibonacci hashing spreads sequential device ids over the table
+        return id*0x9E3779B97F4A7C15ull;
+    }
+
+    bool map(size_t size){
+        //A read only store is a private copy, open() can still drop the broken slots in memory
+        void* p = mmap(NULL,size,PROT_READ|PROT_WRITE,writable ? MAP_SHARED : MAP_PRIVATE,fd,0);
+        if(p==MAP_FAILED)return false;
+        mapped = (uint8_t*)p;
+        mappedSize = size;
+        return true;
+    }
+
+    /** @brief Grows the file (at least doubling it) and maps it again.**/
+    bool grow(uint64_t needed){
+        size_t size = mappedSize;
+        while(size<needed)size*=2;
+        if(size==mappedSize)return true;
+        if(ftruncate(fd,size)!=0)return false;
+        munmap(mapped,mappedSize);
+        mapped=NULL;
+        return map(size);
+    }
+
+    int16_t create(void){
+        size_t size = DTR_STORE_HEADER_SIZE+DTR_STORE_INITIAL_SLOTS*sizeof(Slot);
+        if(ftruncate(fd,size)!=0 || !map(size))return STORE_IO_ERROR;
+        memset(mapped,0,size);
+        Header* h = header();
+        h->magic = DTR_STORE_MAGIC;
+        h->version = DTR_STORE_VERSION;
+        h->featureSize = sizeof(TFeature);
+        h->labelSize = sizeof(TLabel);
+        h->indexOffset = DTR_STORE_HEADER_SIZE;
+        h->slots = DTR_STORE_INITIAL_SLOTS;
+        h->end = size;
+        return 0;
+    }
+
+    Slot* lookup(uint64_t id){
+        if(mapped==NULL)return NULL;
+        uint64_t mask = header()->slots-1;
+        Slot* slots = index();
+        for(uint64_t i=hash(id)&mask;;i=(i+1)&mask){
+            Slot* slot = slots+i;
+            if(slot->offset==DTR_STORE_EMPTY)return NULL;
+            if(slot->offset!=DTR_STORE_REMOVED && slot->id==id)return slot;
+        }
+    }
+
+    /** @brief Makes room for size bytes (8-byte aligned) at the end of the used part.**/
+    int16_t reserve(size_t size, uint64_t* offset){
+        if(!writable || mapped==NULL)return STORE_IO_ERROR;
+        uint64_t start = (header()->end+7)&~(uint64_t)7;
+        if(!grow(start+size))return STORE_IO_ERROR;
+        *offset = start;
+        return 0;
+    }
+
+    /** @brief Points the index slot of the id to the appended model. The header covers the model and the model is on disk before the slot points to it,
+     * until then the bytes are only garbage.
+    **/
+    int16_t commit(uint64_t id, uint64_t offset, size_t size){
+        Header* h = header();
+        h->end = offset+size;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t first = (size_t)offset&~(page-1);
+        if(msync(mapped+first,offset+size-first,MS_SYNC)!=0 || msync(mapped,DTR_STORE_HEADER_SIZE,MS_SYNC)!=0)return STORE_IO_ERROR;
+        Slot* slot = lookup(id);
+        if(slot!=NULL){
+            h->garbage += slot->size;
+            slot->size = size;
+            slot->offset = offset;
+            return 0;
+        }
+        if(2*(h->usedSlots+1)>h->slots){
+            int16_t rslt = rehash();
+            if(rslt!=0)return rslt;
+            h = header();
+        }
+        uint64_t mask = h->slots-1;
+        Slot* slots = index();
+        uint64_t i = hash(id)&mask;
+        while(slots[i].offset!=DTR_STORE_EMPTY)i=(i+1)&mask;
+        slots[i].id = id;
+        slots[i].size = size;
+        slots[i].offset = offset;
+        h->usedSlots++;
+        h->models++;
+        return 0;
+    }
+
+    /** @brief Appends an index twice as large without the removed slots and switches the header to it.**/
+    int16_t rehash(void){
+        uint64_t slots = 2*header()->slots;
+        uint64_t start = (header()->end+7)&~(uint64_t)7;
+        if(!grow(start+slots*sizeof(Slot)))return STORE_IO_ERROR;
+        Header* h = header();
+        Slot* from = index();
+        Slot* to = (Slot*)(mapped+start);
+        memset(to,0,slots*sizeof(Slot));
+        uint64_t used = 0;
+        for(uint64_t k=0;k<h->slots;k++){
+            if(from[k].offset==DTR_STORE_EMPTY || from[k].offset==DTR_STORE_REMOVED)continue;
+            uint64_t i = hash(from[k].id)&(slots-1);
+            while(to[i].offset!=DTR_STORE_EMPTY)i=(i+1)&(slots-1);
+            to[i] = from[k];
+            used++;
+        }
+        h->garbage += h->slots*sizeof(Slot);
+        h->end = start+slots*sizeof(Slot);
+        h->usedSlots = used;
+        h->slots = slots;
+        h->indexOffset = start;
+        return 0;
+    }
+
+    /** @brief Checks a model like importModel does, so predict() can trust the records.**/
+    static bool valid(const uint8_t* model, size_t size){
+        return TinyDecisionTreeClassifier<TFeature,TLabel>::validateModel(model,size)==0;
+    }
+
+    /** @brief Walks the records of a model from the root (the last record) to the leaf, the children always come before the parent.
+     * @return The record of the leaf, NULL if the file is broken.
+    **/
+    static const uint8_t* leafRecord(const uint8_t* model, const TFeature* X){
+        uint16_t outputs;
+        uint32_t count;
+        memcpy(&outputs,model+8,2);
+        memcpy(&count,model+12,4);
+        if(count==0)return NULL;
+        size_t recordSize = 3*sizeof(uint32_t)+sizeof(TFeature)+outputs*sizeof(TLabel);
+        const uint8_t* records = model+DTR_MODEL_HEADER_SIZE;
+        uint32_t n = count-1;
+        for(;;){
+            const uint8_t* record = records+(size_t)n*recordSize;
+            uint32_t fields[3];
+            memcpy(fields,record,sizeof(fields));
+            if(fields[0]==DTR_MODEL_LEAF)return record;
+            TFeature th;
+            memcpy(&th,record+sizeof(fields),sizeof(TFeature));
+            uint32_t next = X[fields[0]]<=th ? fields[1] : fields[2];
+            if(next>=n)return NULL;
+            n = next;
+        }
+    }
+};
+
+#endif
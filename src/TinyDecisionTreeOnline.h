@@ -0,0 +1,259 @@
+/* TinyDecisionTreeClassifier library
+ * Copyright (c) 2023-2024 Aleksei Karavaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Retraining while classifying. Needs <atomic>, so it works on the PC, Esp32 and the ARM MCUs but not on AVR,
+ * it is not included by TinyDecisionTreeClassifier.h.
+ */
+
+#ifndef DECISION_TREE_ONLINE_H
+#define DECISION_TREE_ONLINE_H
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include "TinyDecisionTreeClassifier.h"
+
+/** @brief Training set with a fixed capacity, the newest sample replaces the oldest one in O(1).
+ * The rows are not kept in time order, X and Y point to the slots and can be passed to fit as they are (the order of the rows doesn't matter for the tree).
+ **/
+template <typename TFeature, typename TLabel = uint8_t>
+class TinyRingDataset{
+    public:
+    /** @brief Row pointers for fit, the first size of them are valid.**/
+    TFeature** X=NULL;
+    TLabel** Y=NULL;
+    uint32_t capacity=0;
+    uint32_t size=0;
+    /** @brief Slot the next sample goes to.**/
+    uint32_t head=0;
+    uint32_t features=0;
+    uint16_t outputs=0;
+
+    ~TinyRingDataset(){
+        end();
+    }
+
+    /** @brief Allocates the storage.
+     * @param capacity Maximum number of samples.
+     * @param features Number of features.
+     * @param outputs Number of outputs.
+     * @return False if there is not enough memory.
+    **/
+    bool begin(uint32_t capacity, uint32_t features, uint16_t outputs = 1){
+        end();
+        featureStorage = (TFeature *)malloc((size_t)capacity*features*sizeof(TFeature));
+        labelStorage = (TLabel *)malloc((size_t)capacity*outputs*sizeof(TLabel));
+        X = (TFeature **)malloc(capacity*sizeof(TFeature*));
+        Y = (TLabel **)malloc(capacity*sizeof(TLabel*));
+        if(featureStorage==NULL || labelStorage==NULL || X==NULL || Y==NULL){
+            end();
+            return false;
+        }
+        for(uint32_t i=0;i<capacity;i++){
+            X[i] = featureStorage+(size_t)i*features;
+            Y[i] = labelStorage+(size_t)i*outputs;
+        }
+        this->capacity=capacity;
+        this->features=features;
+        this->outputs=outputs;
+        clear();
+        return true;
+    }
+
+    /** @brief Frees the storage.**/
+    void end(void){
+        free(Y);
+        free(X);
+        free(labelStorage);
+        free(featureStorage);
+        Y=NULL;
+        X=NULL;
+        labelStorage=NULL;
+        featureStorage=NULL;
+        capacity=0;
+        clear();
+    }
+
+    /** @brief Forgets all the samples.**/
+    void clear(void){
+        size=0;
+        head=0;
+    }
+
+    /** @brief Adds a sample, the oldest one is evicted if the dataset is full.
+     * @param x features values.
+     * @param y outputs classes.
+    **/
+    void push(const TFeature* x, const TLabel* y){
+        if(capacity==0)return;
+        memcpy(X[head],x,features*sizeof(TFeature));
+        memcpy(Y[head],y,outputs*sizeof(TLabel));
+        head = head+1==capacity ? 0 : head+1;
+        if(size<capacity)size++;
+    }
+
+    /** @brief Copies the samples of another dataset with the same dimensions.
+     * @param other The dataset to copy.
+    **/
+    void copyFrom(const TinyRingDataset& other){
+        memcpy(featureStorage,other.featureStorage,(size_t)other.size*features*sizeof(TFeature));
+        memcpy(labelStorage,other.labelStorage,(size_t)other.size*outputs*sizeof(TLabel));
+        size=other.size;
+        head=other.head;
+    }
+
+    private:
+    TFeature* featureStorage=NULL;
+    TLabel* labelStorage=NULL;
+};
+
+/** @brief Keeps classifying while a new tree is trained in another thread or task.
+ * Two classifiers take turns: the trainer fits the spare one on a snapshot of the ring dataset and publishes it with an atomic pointer swap.
+ * predict() never blocks, it only registers itself in the reader counter of the classifier it uses.
+ * The previous tree is freed by the next fit into its classifier, which waits until the last reader of that classifier has left.
+ * add() and predict() can be called from any number of threads, retrain() (or task()) from one thread only.
+ **/
+template <typename TFeature, typename TLabel = uint8_t, typename Allocator = TinyMallocAllocator>
+class TinyBackgroundTrainer{
+    public:
+    typedef TinyDecisionTreeClassifier<TFeature,TLabel,Allocator> Classifier;
+
+    /** @brief The two classifiers, set the same hyperparameters on both.**/
+    Classifier models[2];
+    /** @brief task() retrains after this many new samples.**/
+    uint32_t retrainEvery=1;
+    /** @brief Called by task() and while waiting for readers, e.g. vTaskDelay(1) or std::this_thread::yield, NULL spins.**/
+    void (*idle)(void)=NULL;
+    /** @brief Number of published trees.**/
+    std::atomic<uint32_t> generation;
+    /** @brief task() returns when this is set to false.**/
+    std::atomic<bool> running;
+
+    /** @brief The class constructor.
+     * @param maxDepth Maximum possible depth of the trees.
+     * @param minSamplesSplit If the number of samples is less than this number the splitting process stops.
+    **/
+    TinyBackgroundTrainer(uint16_t maxDepth, uint16_t minSamplesSplit = 2) : models{Classifier(maxDepth,minSamplesSplit),Classifier(maxDepth,minSamplesSplit)}{
+        current.store(&models[0]);
+        readers[0].store(0);
+        readers[1].store(0);
+        generation.store(0);
+        running.store(false);
+        pending.store(0);
+        lock.clear();
+    }
+
+    /** @brief Allocates the dataset and its snapshot.
+     * @param capacity Maximum number of samples.
+     * @param features Number of features.
+     * @param outputs Number of outputs.
+     * @return False if there is not enough memory.
+    **/
+    bool begin(uint32_t capacity, uint32_t features, uint16_t outputs = 1){
+        return dataset.begin(capacity,features,outputs) && snapshot.begin(capacity,features,outputs);
+    }
+
+    /** @brief Adds a training sample, the oldest one is evicted if the dataset is full.
+     * @param x features values.
+     * @param y outputs classes.
+    **/
+    void add(const TFeature* x, const TLabel* y){
+        while(lock.test_and_set(std::memory_order_acquire)){}
+        dataset.push(x,y);
+        lock.clear(std::memory_order_release);
+        pending++;
+    }
+
+    /** @brief Classifies the input with the latest published tree, never waits for the trainer.
+     * @param X Input sample.
+     * @return The class of the first output, 0 before the first tree is published.
+    **/
+    TLabel predict(TFeature* X){
+        uint8_t i = acquire();
+        TLabel y = models[i].predict(X);
+        readers[i]--;
+        return y;
+    }
+
+    /** @brief Classifies the input for every output with the latest published tree.
+     * @param X Input sample.
+     * @param Y Output variable, outputs classes.
+    **/
+    void predict(TFeature* X, TLabel* Y){
+        uint8_t i = acquire();
+        models[i].predict(X,Y);
+        readers[i]--;
+    }
+
+    /** @brief Trains the spare classifier on a snapshot of the dataset and publishes it.
+     * @return False if the dataset is empty or the training failed (the published tree stays).
+    **/
+    bool retrain(void){
+        //The producers are blocked only for the copy, not for the fit
+        while(lock.test_and_set(std::memory_order_acquire)){}
+        snapshot.copyFrom(dataset);
+        pending.store(0);
+        lock.clear(std::memory_order_release);
+        if(snapshot.size==0)return false;
+
+        uint8_t spare = current.load()==&models[0] ? 1 : 0;
+        //Readers that took the spare before the previous swap must leave before its tree is freed by fit
+        while(readers[spare].load()!=0){
+            if(idle)idle();
+        }
+        models[spare].fit(snapshot.X,snapshot.Y,snapshot.size,snapshot.features,snapshot.outputs);
+        if(!models[spare].trained)return false;
+        current.store(&models[spare]);
+        generation++;
+        return true;
+    }
+
+    /** @brief Trainer loop for std::thread or a FreeRTOS task, retrains after every retrainEvery new samples until running is false.
+     * @param trainer The TinyBackgroundTrainer.
+    **/
+    static void task(void* trainer){
+        TinyBackgroundTrainer* t = (TinyBackgroundTrainer*)trainer;
+        t->running.store(true);
+        while(t->running.load()){
+            if(t->pending.load()>=t->retrainEvery)t->retrain();
+            else if(t->idle)t->idle();
+        }
+    }
+
+    private:
+    TinyRingDataset<TFeature,TLabel> dataset;
+    TinyRingDataset<TFeature,TLabel> snapshot;
+    std::atomic<Classifier*> current;
+    std::atomic<uint32_t> readers[2];
+    std::atomic<uint32_t> pending;
+    std::atomic_flag lock;
+
+    /** @brief Registers a reader of the published classifier.
+     * @return Index of the classifier, the reader counter has to be decremented after use.
+    **/
+    uint8_t acquire(void){
+        for(;;){
+            Classifier* model = current.load();
+            uint8_t i = model==&models[0] ? 0 : 1;
+            readers[i]++;
+            //If the trainer swapped in between, it may already be fitting this one
+            if(current.load()==model)return i;
+            readers[i]--;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,245 @@
+/* TinyDecisionTreeClassifier library
+ * Copyright (c) 2023-2024 Aleksei Karavaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Bit-vector inference for trees with at most 64 leaves. Works everywhere, but the 64-bit masks only pay off on 32/64-bit CPUs,
+ * it is not included by TinyDecisionTreeClassifier.h.
+ */
+
+#ifndef DECISION_TREE_QUICK_SCORER_H
+#define DECISION_TREE_QUICK_SCORER_H
+#include <stdint.h>
+#include <stddef.h>
+#include "TinyDecisionTreeClassifier.h"
+
+#define TOO_MANY_LEAVES                                 -5
+
+/** @brief Maximum number of leaves of a tree the scorer can take, one bit of the leaf mask per leaf.**/
+#define DTR_QUICK_SCORER_MAX_LEAVES                     64
+
+/** @brief QuickScorer-style predict for small trees. The leaves are numbered from left to right, every split is stored under its feature
+ * as its threshold and the mask of the leaves it removes when the comparison is false (the leaves of its left subtree).
+ * A prediction starts with all the leaves and ANDs the masks of the splits whose comparison is false, the exit leaf is the lowest bit left.
+ * There are no pointers, the thresholds of a feature are sorted and read sequentially until the first one the feature doesn't exceed.
+ * The scorer is a copy, the classifier can be refitted or freed after build().
+ **/
+template <typename TFeature, typename TLabel = uint8_t, typename Allocator = TinyMallocAllocator>
+class TinyQuickScorer{
+    public:
+    typedef TinyDecisionTreeClassifier<TFeature,TLabel,Allocator> Classifier;
+
+    /** @brief Memory of the tables.**/
+    Allocator allocator;
+    /** @brief Number of features (the largest column used by a split plus one), leaves and outputs of the built tree.**/
+    uint32_t features=0;
+    uint32_t leaves=0;
+    uint16_t outputs=0;
+
+    TinyQuickScorer(){}
+
+    ~TinyQuickScorer(){
+        release();
+    }
+
+    TinyQuickScorer(const TinyQuickScorer&) = delete;
+    TinyQuickScorer& operator=(const TinyQuickScorer&) = delete;
+
+    /** @brief Builds the tables from a trained classifier. Subtrees shared by compact() are unfolded, every path gets its own leaves.
+     * @param clf The trained classifier.
+     * @return 0, TOO_MANY_LEAVES (more than DTR_QUICK_SCORER_MAX_LEAVES) or NOT_ENOUGH_MEMORY.
+    **/
+    int16_t build(Classifier& clf){
+        release();
+        if(!clf.trained)return 0;
+        uint32_t splits = 0;
+        uint32_t leafCount = 0;
+        uint32_t maxColumn = 0;
+        count(clf.root,&splits,&leafCount,&maxColumn);
+        if(leafCount>DTR_QUICK_SCORER_MAX_LEAVES)return TOO_MANY_LEAVES;
+
+        features = splits ? maxColumn+1 : 0;
+        leaves = leafCount;
+        outputs = clf.outputs;
+        offsets = (uint32_t *)allocator.allocate((features+1)*sizeof(uint32_t));
+        thresholds = (TFeature *)allocator.allocate((splits ? splits : 1)*sizeof(TFeature));
+        masks = (uint64_t *)allocator.allocate((splits ? splits : 1)*sizeof(uint64_t));
+        decisions = (TLabel *)allocator.allocate(leaves*outputs*sizeof(TLabel));
+        uint32_t* order = (uint32_t *)allocator.allocate((splits ? splits : 1)*sizeof(uint32_t));
+        uint64_t* unsorted = (uint64_t *)allocator.allocate((splits ? splits : 1)*sizeof(uint64_t));
+        if(offsets==NULL || thresholds==NULL || masks==NULL || decisions==NULL || order==NULL || unsorted==NULL){
+            if(unsorted)allocator.deallocate(unsorted,(splits ? splits : 1)*sizeof(uint64_t));
+            if(order)allocator.deallocate(order,(splits ? splits : 1)*sizeof(uint32_t));
+            release();
+            return NOT_ENOUGH_MEMORY;
+        }
+        tablesSize = splits;
+
+        //offsets[f] is where the thresholds of feature f start, filled as the running end of every feature first
+        for(uint32_t f=0;f<=features;f++)offsets[f]=0;
+        countColumns(clf.root);
+        uint32_t start = 0;
+        for(uint32_t f=0;f<features;f++){
+            uint32_t n = offsets[f+1];
+            offsets[f+1] = start;
+            start += n;
+        }
+        uint32_t leaf = 0;
+        fill(clf.root,&leaf);
+
+        //Each feature is sorted on its own, the masks follow their thresholds
+        for(uint32_t k=0;k<splits;k++)unsorted[k]=masks[k];
+        for(uint32_t f=0;f<features;f++){
+            uint32_t n = offsets[f+1]-offsets[f];
+            for(uint32_t j=0;j<n;j++)order[j]=j;
+            TinySort<TFeature>::sort(thresholds+offsets[f],order,n,&allocator);
+            for(uint32_t j=0;j<n;j++)masks[offsets[f]+j]=unsorted[offsets[f]+order[j]];
+        }
+        allocator.deallocate(unsorted,(splits ? splits : 1)*sizeof(uint64_t));
+        allocator.deallocate(order,(splits ? splits : 1)*sizeof(uint32_t));
+        return 0;
+    }
+
+    /** @brief Frees the tables.**/
+    void release(void){
+        if(decisions)allocator.deallocate(decisions,leaves*outputs*sizeof(TLabel));
+        if(masks)allocator.deallocate(masks,(tablesSize ? tablesSize : 1)*sizeof(uint64_t));
+        if(thresholds)allocator.deallocate(thresholds,(tablesSize ? tablesSize : 1)*sizeof(TFeature));
+        if(offsets)allocator.deallocate(offsets,(features+1)*sizeof(uint32_t));
+        decisions=NULL;
+        masks=NULL;
+        thresholds=NULL;
+        offsets=NULL;
+        tablesSize=0;
+        features=0;
+        leaves=0;
+        outputs=0;
+    }
+
+    /** @brief Classifies the input, the same result as the predict() of the classifier it was built from.
+     * @param X Input sample.
+     * @return The class of the first output, 0 if nothing was built.
+    **/
+    TLabel predict(const TFeature* X){
+        if(leaves==0)return 0;
+        return decisions[exitLeaf(X)*outputs];
+    }
+
+    /** @brief Classifies the input for every output.
+     * @param X Input sample.
+     * @param Y Output variable, outputs classes.
+    **/
+    void predict(const TFeature* X, TLabel* Y){
+        if(leaves==0){
+            for(uint16_t o=0;o<outputs;o++)Y[o]=0;
+            return;
+        }
+        const TLabel* leaf = decisions+exitLeaf(X)*outputs;
+        for(uint16_t o=0;o<outputs;o++)Y[o]=leaf[o];
+    }
+
+    private:
+    uint32_t* offsets=NULL;
+    TFeature* thresholds=NULL;
+    uint64_t* masks=NULL;
+    TLabel* decisions=NULL;
+    uint32_t tablesSize=0;
+
+    typedef typename Classifier::Node Node;
+
+    static bool isLeaf(Node* node){
+        return node->decisionReady || !node->thReady || node->children[0]==NULL;
+    }
+
+    /** @brief Counts the splits and leaves of every path, the shared subtrees are counted once per path.**/
+    static void count(Node* node, uint32_t* splits, uint32_t* leafCount, uint32_t* maxColumn){
+        if(isLeaf(node)){
+            (*leafCount)++;
+            return;
+        }
+        (*splits)++;
+        if(node->nodeThColumn>*maxColumn)*maxColumn=node->nodeThColumn;
+        //The count can stop growing once it is too large, the caller only checks the limit
+        if(*leafCount>DTR_QUICK_SCORER_MAX_LEAVES)return;
+        count(node->children[0],splits,leafCount,maxColumn);
+        count(node->children[1],splits,leafCount,maxColumn);
+    }
+
+    /** @brief Counts the splits of every feature into offsets[column+1].**/
+    void countColumns(Node* node){
+        if(isLeaf(node))return;
+        offsets[node->nodeThColumn+1]++;
+        countColumns(node->children[0]);
+        countColumns(node->children[1]);
+    }
+
+    /** @brief Numbers the leaves from left to right, stores their decisions and the splits with the masks of their left subtrees.
+     * @param node The subtree.
+     * @param leaf Number of the next leaf.
+    **/
+    void fill(Node* node, uint32_t* leaf){
+        if(isLeaf(node)){
+            TLabel* d = decisions+(*leaf)*outputs;
+            for(uint16_t o=0;o<outputs;o++)d[o]=0;
+            if(node->decisionReady){
+                if(node->decisions){
+                    for(uint16_t o=0;o<outputs;o++)d[o]=node->decisions[o];
+                }else{
+                    d[0]=node->decision;
+                }
+            }
+            (*leaf)++;
+            return;
+        }
+        uint32_t first = *leaf;
+        fill(node->children[0],leaf);
+        //The right subtree has a leaf too, so the left one has less than 64
+        uint64_t left = (((uint64_t)1<<(*leaf-first))-1)<<first;
+        uint32_t k = offsets[node->nodeThColumn+1]++;
+        thresholds[k] = node->nodeTh;
+        masks[k] = ~left;
+        fill(node->children[1],leaf);
+    }
+
+    /** @brief Number of the leaf X ends in.**/
+    uint32_t exitLeaf(const TFeature* X){
+        uint64_t alive = ~(uint64_t)0;
+        for(uint32_t f=0;f<features;f++){
+            TFeature x = X[f];
+            uint32_t end = offsets[f+1];
+            //The thresholds are ascending, once x<=threshold holds it holds for the rest of the feature.
+            //The same comparison as the tree walk, NaN is never <= and goes right on every split
+            for(uint32_t k=offsets[f];k<end;k++){
+                if(x<=thresholds[k])break;
+                alive &= masks[k];
+            }
+        }
+        return lowestBit(alive);
+    }
+
+    static uint32_t lowestBit(uint64_t v){
+        #if defined(__GNUC__) || defined(__clang__)
+        return (uint32_t)__builtin_ctzll(v);
+        #else
+        uint32_t n = 0;
+        while((v&1)==0){
+            v >>= 1;
+            n++;
+        }
+        return n;
+        #endif
+    }
+};
+
+#endif
@@ -0,0 +1,294 @@
+/* TinyDecisionTreeClassifier library
+ * Copyright (c) 2023-2024 Aleksei Karavaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host side model selection (std::thread), it is not included by TinyDecisionTreeClassifier.h
+ * and is meant for the training PC, not for the MCUs.
+ */
+
+#ifndef DECISION_TREE_SEARCH_H
+#define DECISION_TREE_SEARCH_H
+#include <stdlib.h>
+#include <stdint.h>
+#include <thread>
+#include <atomic>
+#include "TinyDecisionTreeClassifier.h"
+
+#define NOT_ENOUGH_SAMPLES_FOR_THE_FOLDS                -3
+
+/** @brief K-fold cross-validated grid search over maxDepth and minSamplesSplit.
+ * Every column is sorted once, the folds take their rows from the sorted lists by masking the held-out rows out.
+ * For every fold and minSamplesSplit only one tree is grown (with the largest maxDepth), the smaller depths are scored by cutting it.
+ * With a random feature subspace (maxFeatures) a shallower fit draws other features, so then every depth gets its own tree.
+ * The folds and minSamplesSplit values are spread over a pool of threads.
+ **/
+template <typename TFeature, typename TLabel = uint8_t>
+class TinyDecisionTreeGridSearch{
+    public:
+    /** @brief Number of folds, at least 2.**/
+    uint16_t folds=5;
+    /** @brief Number of worker threads, 0 uses all the hardware threads.**/
+    uint16_t threads=0;
+    /** @brief Seed of the shuffle that assigns the rows to the folds, also passed to every tree.**/
+    uint32_t randomSeed=1;
+    /** @brief maxFeatures of every tree. Anything but DTR_MAX_FEATURES_ALL fits one tree per depth instead of cutting the deepest one.**/
+    uint16_t maxFeatures=DTR_MAX_FEATURES_ALL;
+    /** @brief featureCosts and costPenalty of every tree.**/
+    const float* featureCosts=NULL;
+    float costPenalty=0;
+
+    /** @brief Values of maxDepth to check.**/
+    const uint16_t* depths=NULL;
+    uint16_t depthsCount=0;
+    /** @brief Values of minSamplesSplit to check.**/
+    const uint16_t* minSamplesSplits=NULL;
+    uint16_t minSamplesSplitsCount=0;
+
+    /** @brief Output, cross-validated accuracy of every combination, scores[m*depthsCount+d] is for minSamplesSplits[m] and depths[d].**/
+    float* scores=NULL;
+    /** @brief Output, the best combination.**/
+    uint16_t bestMaxDepth=0;
+    uint16_t bestMinSamplesSplit=0;
+    float bestScore=0;
+
+    /** @brief The class constructor.
+     * @param depths Values of maxDepth to check.
+     * @param depthsCount Number of the values.
+     * @param minSamplesSplits Values of minSamplesSplit to check.
+     * @param minSamplesSplitsCount Number of the values.
+    **/
+    TinyDecisionTreeGridSearch(const uint16_t* depths, uint16_t depthsCount, const uint16_t* minSamplesSplits, uint16_t minSamplesSplitsCount){
+        this->depths=depths;
+        this->depthsCount=depthsCount;
+        this->minSamplesSplits=minSamplesSplits;
+        this->minSamplesSplitsCount=minSamplesSplitsCount;
+    }
+
+    ~TinyDecisionTreeGridSearch(){
+        free(scores);
+    }
+
+    /** @brief Runs the search, the results are in scores, bestMaxDepth, bestMinSamplesSplit and bestScore.
+     * @param X Input samples.
+     * @param Y Input classes.
+     * @param rows Number of samples.
+     * @param Xcols Number of features.
+     * @param Ycols Number of outputs.
+     * @return 0, NOT_ENOUGH_MEMORY or NOT_ENOUGH_SAMPLES_FOR_THE_FOLDS.
+    **/
+    int16_t search(TFeature** X, TLabel** Y, uint32_t rows, uint32_t Xcols, uint16_t Ycols = 1){
+        if(folds<2 || rows<folds || depthsCount==0 || minSamplesSplitsCount==0)return NOT_ENOUGH_SAMPLES_FOR_THE_FOLDS;
+        free(scores);
+        scores = (float *)calloc(depthsCount*minSamplesSplitsCount,sizeof(float));
+        uint32_t* sorted = (uint32_t *)malloc((size_t)rows*Xcols*sizeof(uint32_t));
+        uint16_t* foldOf = (uint16_t *)malloc(rows*sizeof(uint16_t));
+        uint32_t* matches = (uint32_t *)calloc((size_t)folds*depthsCount*minSamplesSplitsCount,sizeof(uint32_t));
+        int16_t rslt = 0;
+        if(scores==NULL || sorted==NULL || foldOf==NULL || matches==NULL || !presort(X,rows,Xcols,sorted)){
+            rslt = NOT_ENOUGH_MEMORY;
+        }else{
+            assignFolds(rows,foldOf);
+
+            Job job;
+            job.search = this;
+            job.X = X;
+            job.Y = Y;
+            job.rows = rows;
+            job.cols = Xcols;
+            job.outputs = Ycols;
+            job.sorted = sorted;
+            job.foldOf = foldOf;
+            job.matches = matches;
+            job.next = 0;
+            job.failed = false;
+            job.tasks = (uint32_t)folds*minSamplesSplitsCount;
+
+            uint32_t workers = threads ? threads : std::thread::hardware_concurrency();
+            if(workers==0)workers=1;
+            if(workers>job.tasks)workers=job.tasks;
+            std::thread* pool = new std::thread[workers-1];
+            for(uint32_t i=0;i<workers-1;i++){
+                pool[i] = std::thread(work,&job);
+            }
+            work(&job);
+            for(uint32_t i=0;i<workers-1;i++){
+                pool[i].join();
+            }
+            delete[] pool;
+
+            if(job.failed){
+                rslt = NOT_ENOUGH_MEMORY;
+            }else{
+                //Every row is held out exactly once, so the matches of all the folds add up to one accuracy
+                bestScore = -1;
+                for(uint16_t m=0;m<minSamplesSplitsCount;m++){
+                    for(uint16_t d=0;d<depthsCount;d++){
+                        uint64_t total = 0;
+                        for(uint16_t f=0;f<folds;f++){
+                            total += matches[((size_t)f*minSamplesSplitsCount+m)*depthsCount+d];
+                        }
+                        float score = (float)total/((float)rows*Ycols);
+                        scores[m*depthsCount+d] = score;
+                        if(score>bestScore){
+                            bestScore = score;
+                            bestMaxDepth = depths[d];
+                            bestMinSamplesSplit = minSamplesSplits[m];
+                        }
+                    }
+                }
+            }
+        }
+        free(matches);
+        free(foldOf);
+        free(sorted);
+        return rslt;
+    }
+
+    private:
+    struct Job{
+        TinyDecisionTreeGridSearch* search;
+        TFeature** X;
+        TLabel** Y;
+        uint32_t rows;
+        uint32_t cols;
+        uint16_t outputs;
+        uint32_t* sorted;
+        uint16_t* foldOf;
+        uint32_t* matches;
+        uint32_t tasks;
+        std::atomic<uint32_t> next;
+        std::atomic<bool> failed;
+    };
+
+    /** @brief Sorts the row indexes by every column once.
+     * @param sorted Output variable, cols lists of rows indexes.
+    **/
+    bool presort(TFeature** X, uint32_t rows, uint32_t cols, uint32_t* sorted){
+        TinyMallocAllocator allocator;
+        TFeature* values = (TFeature *)malloc(rows*sizeof(TFeature));
+        if(values==NULL)return false;
+        for(uint32_t c=0;c<cols;c++){
+            uint32_t* list = sorted+(size_t)c*rows;
+            for(uint32_t i=0;i<rows;i++){
+                values[i]=X[i][c];
+                list[i]=i;
+            }
+            TinySort<TFeature>::sort(values,list,rows,&allocator);
+        }
+        free(values);
+        return true;
+    }
+
+    /** @brief Shuffles the rows (Fisher-Yates, xorshift32) and deals them to the folds.
+     * @param foldOf Output variable, the fold every row is held out in.
+    **/
+    void assignFolds(uint32_t rows, uint16_t* foldOf){
+        uint32_t state = randomSeed ? randomSeed : 1;
+        for(uint32_t i=0;i<rows;i++){
+            foldOf[i] = i%folds;
+        }
+        for(uint32_t i=rows-1;i>0;i--){
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            uint32_t j = state%(i+1);
+            uint16_t t = foldOf[i];
+            foldOf[i] = foldOf[j];
+            foldOf[j] = t;
+        }
+    }
+
+    /** @brief Worker thread, takes (fold, minSamplesSplit) tasks until there are none left.**/
+    static void work(Job* job){
+        TinyDecisionTreeGridSearch* search = job->search;
+        uint32_t rows = job->rows;
+        uint32_t cols = job->cols;
+        uint16_t maxDepth = 0;
+        for(uint16_t d=0;d<search->depthsCount;d++){
+            if(search->depths[d]==0){
+                maxDepth = 0;
+                break;
+            }
+            if(search->depths[d]>maxDepth)maxDepth=search->depths[d];
+        }
+        for(uint32_t task=job->next++;task<job->tasks;task=job->next++){
+            uint16_t fold = task/search->minSamplesSplitsCount;
+            uint16_t m = task%search->minSamplesSplitsCount;
+
+            uint32_t heldOut = 0;
+            for(uint32_t i=0;i<rows;i++){
+                if(job->foldOf[i]==fold)heldOut++;
+            }
+            uint32_t n = rows-heldOut;
+            uint32_t* sorted = (uint32_t *)malloc((size_t)n*cols*sizeof(uint32_t));
+            TFeature** Xt = (TFeature **)malloc(heldOut*sizeof(TFeature*));
+            TLabel** Yt = (TLabel **)malloc(heldOut*sizeof(TLabel*));
+            if(sorted==NULL || Xt==NULL || Yt==NULL){
+                free(Yt);
+                free(Xt);
+                free(sorted);
+                job->failed = true;
+                continue;
+            }
+            uint32_t k = 0;
+            for(uint32_t i=0;i<rows;i++){
+                if(job->foldOf[i]==fold){
+                    Xt[k] = job->X[i];
+                    Yt[k] = job->Y[i];
+                    k++;
+                }
+            }
+
+            //One deep tree answers for all the depths, the inner nodes keep their majority classes.
+            //The random subspace of a shallower fit differs from the top of the deep tree, so then each depth is fitted
+            bool oneTree = search->maxFeatures==DTR_MAX_FEATURES_ALL;
+            uint32_t* matches = job->matches+((size_t)fold*search->minSamplesSplitsCount+m)*search->depthsCount;
+            for(uint16_t d=0;d<(oneTree ? 1 : search->depthsCount);d++){
+                //Masking the held-out rows keeps the global order, so the fold doesn't sort anything.
+                //The fit partitions the lists in place, so they are masked again for every tree
+                for(uint32_t c=0;c<cols;c++){
+                    uint32_t* list = job->sorted+(size_t)c*rows;
+                    uint32_t* foldList = sorted+(size_t)c*n;
+                    uint32_t f = 0;
+                    for(uint32_t i=0;i<rows;i++){
+                        if(job->foldOf[list[i]]!=fold)foldList[f++]=list[i];
+                    }
+                }
+                TinyDecisionTreeClassifier<TFeature,TLabel> clf(oneTree ? maxDepth : search->depths[d],search->minSamplesSplits[m]);
+                clf.maxFeatures = search->maxFeatures;
+                clf.randomSeed = search->randomSeed;
+                clf.featureCosts = search->featureCosts;
+                clf.costPenalty = search->costPenalty;
+                clf.fitPresorted(job->X,job->Y,rows,sorted,n,cols,job->outputs);
+                if(!clf.trained){
+                    job->failed = true;
+                    break;
+                }
+                if(oneTree){
+                    for(uint16_t e=0;e<search->depthsCount;e++){
+                        matches[e] = clf.countMatches(Xt,Yt,heldOut,search->depths[e]);
+                    }
+                }else{
+                    matches[d] = clf.countMatches(Xt,Yt,heldOut,0);
+                }
+            }
+            free(Yt);
+            free(Xt);
+            free(sorted);
+        }
+    }
+};
+
+#endif
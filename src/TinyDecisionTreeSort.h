@@ -0,0 +1,347 @@
+/* TinyDecisionTreeClassifier library
+ * Copyright (c) 2023-2024 Aleksei Karavaev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DECISION_TREE_SORT_H
+#define DECISION_TREE_SORT_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/** @brief Arrays shorter than this are sorted with insertion sort.**/
+#ifndef TINY_SORT_INSERTION_THRESHOLD
+    #define TINY_SORT_INSERTION_THRESHOLD   16
+#endif
+
+/** @brief Arrays of radix sortable types at least this long are sorted with counting/radix sort.**/
+#ifndef TINY_SORT_RADIX_THRESHOLD
+    #define TINY_SORT_RADIX_THRESHOLD       64
+#endif
+
+/** @brief 0 leaves out the counting/radix sort, its 1 KB count array and scratch copy don't fit the 2 KB RAM of AVR boards.**/
+#ifndef TINY_SORT_RADIX
+    #if defined(__AVR__)
+        #define TINY_SORT_RADIX             0
+    #else
+        #define TINY_SORT_RADIX             1
+    #endif
+#endif
+
+/** @brief Maps a value to an unsigned key with the same order (get) and back (restore). bytes=0 means the type is not radix sortable.**/
+template <typename T>
+struct TinySortRadixKey{
+    static const uint8_t bytes = 0;
+    static uint32_t get(T value){(void)value;return 0;}
+    static T restore(uint32_t key){(void)key;return T();}
+};
+
+template <>
+struct TinySortRadixKey<uint8_t>{
+    static const uint8_t bytes = 1;
+    static uint32_t get(uint8_t value){return value;}
+    static uint8_t restore(uint32_t key){return (uint8_t)key;}
+};
+
+template <>
+struct TinySortRadixKey<int8_t>{
+    static const uint8_t bytes = 1;
+    static uint32_t get(int8_t value){return ((uint8_t)value)^0x80u;}
+    static int8_t restore(uint32_t key){return (int8_t)(uint8_t)(key^0x80u);}
+};
+
+template <>
+struct TinySortRadixKey<uint16_t>{
+    static const uint8_t bytes = 2;
+    static uint32_t get(uint16_t value){return value;}
+    static uint16_t restore(uint32_t key){return (uint16_t)key;}
+};
+
+template <>
+struct TinySortRadixKey<int16_t>{
+    static const uint8_t bytes = 2;
+    static uint32_t get(int16_t value){return ((uint16_t)value)^0x8000u;}
+    static int16_t restore(uint32_t key){return (int16_t)(uint16_t)(key^0x8000u);}
+};
+
+template <>
+struct TinySortRadixKey<uint32_t>{
+    static const uint8_t bytes = 4;
+    static uint32_t get(uint32_t value){return value;}
+    static uint32_t restore(uint32_t key){return key;}
+};
+
+template <>
+struct TinySortRadixKey<int32_t>{
+    static const uint8_t bytes = 4;
+    static uint32_t get(int32_t value){return ((uint32_t)value)^0x80000000u;}
+    static int32_t restore(uint32_t key){return (int32_t)(key^0x80000000u);}
+};
+
+template <>
+struct TinySortRadixKey<float>{
+    static const uint8_t bytes = sizeof(float)==4 ? 4 : 0;
+    static uint32_t get(float value){
+        uint32_t key;
+        memcpy(&key,&value,sizeof(key));
+        //Negative numbers have reversed order, positive ones just need to be placed above them
+        return (key&0x80000000u) ? ~key : (key|0x80000000u);
+    }
+    static float restore(uint32_t key){
+        key = (key&0x80000000u) ? (key&0x7FFFFFFFu) : ~key;
+        float value;
+        memcpy(&value,&key,sizeof(value));
+        return value;
+    }
+};
+
+/** @brief Sorting used by the tree. The data are sorted in place in ascending order, the optional idx array is permuted along with the data.
+ * Radix sortable types (8/16/32-bit integers and float) use counting sort (8-bit) or LSD radix sort when the array is long enough
+ * and TINY_SORT_RADIX is on, everything else goes to introsort, which is O(Nlog(N)) in the worst case. Short arrays use insertion sort.
+ **/
+template <typename T>
+class TinySort{
+    public:
+    /** @brief Sorts the data in place.
+     * @param ar A pointer to array of data to sort.
+     * @param n Array size
+     * @param allocator Allocator policy for the counting/radix sort buffers, if it fails introsort is used.
+      **/
+    template <typename Allocator>
+    static void sort(T* ar, uint32_t n, Allocator* allocator){
+        sort(ar,(uint32_t*)NULL,n,allocator);
+    }
+
+    /** @brief Sorts the data in place.
+     * @param ar A pointer to array of data to sort.
+     * @param idx Pointer to an array of indices, that describes which index ended up where after the sort. Can be NULL.
+     * @param n Array size
+     * @param allocator Allocator policy for the counting/radix sort buffers, if it fails introsort is used.
+      **/
+    template <typename Allocator>
+    static void sort(T* ar, uint32_t* idx, uint32_t n, Allocator* allocator){
+        if(n<2)return;
+        #if TINY_SORT_RADIX
+        if(TinySortRadixKey<T>::bytes!=0 && n>=TINY_SORT_RADIX_THRESHOLD){
+            if(radixSort(ar,idx,n,allocator))return;
+        }
+        #else
+        (void)allocator;
+        #endif
+        uint16_t depthLimit=0;
+        for(uint32_t i=n;i>1;i>>=1)depthLimit+=2;
+        introSort(ar,idx,n,depthLimit);
+    }
+
+    /** @brief Introsort, quicksort with median of three pivot that falls back to heapsort when the recursion gets too deep.
+     * @param ar A pointer to array of data to sort.
+     * @param idx Pointer to an array of indices or NULL.
+     * @param n Array size
+     * @param depthLimit How many partitioning levels are allowed before switching to heapsort.
+      **/
+    static void introSort(T* ar, uint32_t* idx, uint32_t n, uint16_t depthLimit){
+        while(n>TINY_SORT_INSERTION_THRESHOLD){
+            if(depthLimit==0){
+                heapSort(ar,idx,n);
+                return;
+            }
+            depthLimit--;
+            uint32_t m = (n-1)/2;
+            sort3(ar,idx,0,m,n-1);
+            T p = ar[m];
+            //Hoare partition, the elements equal to the pivot are spread over both sides
+            int32_t i = -1;
+            int32_t j = n;
+            while(true){
+                do{i++;}while(ar[i]<p);
+                do{j--;}while(ar[j]>p);
+                if(i>=j)break;
+                swap(ar,idx,i,j);
+            }
+            uint32_t left = j+1;
+            //Recurse into the smaller part, so the stack stays O(log(N))
+            if(left<n-left){
+                introSort(ar,idx,left,depthLimit);
+                ar+=left;
+                if(idx)idx+=left;
+                n-=left;
+            }else{
+                introSort(ar+left,idx ? idx+left : NULL,n-left,depthLimit);
+                n=left;
+            }
+        }
+        insertionSort(ar,idx,n);
+    }
+
+    /** @brief Insertion sort for short arrays, 2 and 3 elements are sorted with sorting networks.
+     * @param ar A pointer to array of data to sort.
+     * @param idx Pointer to an array of indices or NULL.
+     * @param n Array size
+      **/
+    static void insertionSort(T* ar, uint32_t* idx, uint32_t n){
+        if(n==2){
+            compareSwap(ar,idx,0,1);
+            return;
+        }
+        if(n==3){
+            sort3(ar,idx,0,1,2);
+            return;
+        }
+        for(uint32_t i=1;i<n;i++){
+            T v = ar[i];
+            uint32_t vi = idx ? idx[i] : 0;
+            uint32_t j = i;
+            while(j>0 && ar[j-1]>v){
+                ar[j]=ar[j-1];
+                if(idx)idx[j]=idx[j-1];
+                j--;
+            }
+            ar[j]=v;
+            if(idx)idx[j]=vi;
+        }
+    }
+
+    /** @brief Heapsort, used by introsort as the worst case fallback.
+     * @param ar A pointer to array of data to sort.
+     * @param idx Pointer to an array of indices or NULL.
+     * @param n Array size
+      **/
+    static void heapSort(T* ar, uint32_t* idx, uint32_t n){
+        for(uint32_t i=n/2;i>0;i--){
+            siftDown(ar,idx,i-1,n);
+        }
+        for(uint32_t i=n-1;i>0;i--){
+            swap(ar,idx,0,i);
+            siftDown(ar,idx,0,i);
+        }
+    }
+
+    /** @brief Stable LSD radix sort by bytes, for 8-bit types without indices it is a plain 256-bucket counting sort.
+     * @param ar A pointer to array of data to sort.
+     * @param idx Pointer to an array of indices or NULL.
+     * @param n Array size
+     * @param allocator Allocator policy for the buckets and the ping-pong buffers.
+     * @return false if the memory couldn't be allocated, the data are left untouched then.
+      **/
+    template <typename Allocator>
+    static bool radixSort(T* ar, uint32_t* idx, uint32_t n, Allocator* allocator){
+        const uint8_t bytes = TinySortRadixKey<T>::bytes;
+        uint32_t* counts = (uint32_t*)allocator->allocate(256*sizeof(uint32_t));
+        if(counts==NULL)return false;
+
+        if(bytes==1 && idx==NULL){
+            memset(counts,0,256*sizeof(uint32_t));
+            for(uint32_t i=0;i<n;i++){
+                counts[TinySortRadixKey<T>::get(ar[i])]++;
+            }
+            uint32_t k=0;
+            for(uint32_t b=0;b<256;b++){
+                for(uint32_t c=0;c<counts[b];c++){
+                    ar[k++]=TinySortRadixKey<T>::restore(b);
+                }
+            }
+            allocator->deallocate(counts,256*sizeof(uint32_t));
+            return true;
+        }
+
+        T* tmpAr = (T*)allocator->allocate(n*sizeof(T));
+        uint32_t* tmpIdx = NULL;
+        if(tmpAr!=NULL && idx!=NULL){
+            tmpIdx = (uint32_t*)allocator->allocate(n*sizeof(uint32_t));
+        }
+        if(tmpAr==NULL || (idx!=NULL && tmpIdx==NULL)){
+            if(tmpAr)allocator->deallocate(tmpAr,n*sizeof(T));
+            allocator->deallocate(counts,256*sizeof(uint32_t));
+            return false;
+        }
+
+        T* srcAr = ar;
+        T* dstAr = tmpAr;
+        uint32_t* srcIdx = idx;
+        uint32_t* dstIdx = tmpIdx;
+        for(uint8_t b=0;b<bytes;b++){
+            uint8_t shift = b*8;
+            memset(counts,0,256*sizeof(uint32_t));
+            for(uint32_t i=0;i<n;i++){
+                counts[(TinySortRadixKey<T>::get(srcAr[i])>>shift)&0xFF]++;
+            }
+            //All the keys share this byte (e.g. small values in a wide type), nothing to do
+            if(counts[(TinySortRadixKey<T>::get(srcAr[0])>>shift)&0xFF]==n)continue;
+
+            uint32_t sum=0;
+            for(uint32_t k=0;k<256;k++){
+                uint32_t c=counts[k];
+                counts[k]=sum;
+                sum+=c;
+            }
+            for(uint32_t i=0;i<n;i++){
+                uint32_t pos = counts[(TinySortRadixKey<T>::get(srcAr[i])>>shift)&0xFF]++;
+                dstAr[pos]=srcAr[i];
+                if(idx)dstIdx[pos]=srcIdx[i];
+            }
+            T* t = srcAr;
+            srcAr = dstAr;
+            dstAr = t;
+            uint32_t* ti = srcIdx;
+            srcIdx = dstIdx;
+            dstIdx = ti;
+        }
+        if(srcAr!=ar){
+            memcpy(ar,srcAr,n*sizeof(T));
+            if(idx)memcpy(idx,srcIdx,n*sizeof(uint32_t));
+        }
+
+        if(tmpIdx)allocator->deallocate(tmpIdx,n*sizeof(uint32_t));
+        allocator->deallocate(tmpAr,n*sizeof(T));
+        allocator->deallocate(counts,256*sizeof(uint32_t));
+        return true;
+    }
+
+    private:
+    static void swap(T* ar, uint32_t* idx, uint32_t i, uint32_t j){
+        T t = ar[i];
+        ar[i] = ar[j];
+        ar[j] = t;
+        if(idx){
+            uint32_t ti = idx[i];
+            idx[i] = idx[j];
+            idx[j] = ti;
+        }
+    }
+
+    static void compareSwap(T* ar, uint32_t* idx, uint32_t i, uint32_t j){
+        if(ar[j]<ar[i])swap(ar,idx,i,j);
+    }
+
+    static void sort3(T* ar, uint32_t* idx, uint32_t a, uint32_t b, uint32_t c){
+        compareSwap(ar,idx,a,b);
+        compareSwap(ar,idx,b,c);
+        compareSwap(ar,idx,a,b);
+    }
+
+    static void siftDown(T* ar, uint32_t* idx, uint32_t i, uint32_t n){
+        while(true){
+            uint32_t largest = i;
+            uint32_t l = 2*i+1;
+            uint32_t r = l+1;
+            if(l<n && ar[l]>ar[largest])largest=l;
+            if(r<n && ar[r]>ar[largest])largest=r;
+            if(largest==i)return;
+            swap(ar,idx,i,largest);
+            i=largest;
+        }
+    }
+};
+
+#endif